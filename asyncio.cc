@@ -0,0 +1,447 @@
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "asyncio.h"
+
+
+SIZE_T PreadvAll(const int fd, off_t off, struct iovec *iov, int iovcnt)
+{
+  SIZE_T done=0;
+
+  while (iovcnt>0) {
+    ssize_t got=preadv(fd,iov,iovcnt<IOV_MAX ? iovcnt : IOV_MAX,off);
+    if (got<0 && errno==EINTR) {
+      continue;
+    }
+    if (got<=0) {
+      break;
+    }
+    done+=got;
+    off+=got;
+    while (iovcnt>0 && (size_t)got>=iov->iov_len) {
+      got-=iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt>0) {
+      iov->iov_base=(BYTE_T *)iov->iov_base+got;
+      iov->iov_len-=got;
+    }
+  }
+  return done;
+}
+
+SIZE_T PwritevAll(const int fd, off_t off, struct iovec *iov, int iovcnt)
+{
+  SIZE_T done=0;
+
+  while (iovcnt>0) {
+    ssize_t sent=pwritev(fd,iov,iovcnt<IOV_MAX ? iovcnt : IOV_MAX,off);
+    if (sent<0 && errno==EINTR) {
+      continue;
+    }
+    if (sent<=0) {
+      break;
+    }
+    done+=sent;
+    off+=sent;
+    while (iovcnt>0 && (size_t)sent>=iov->iov_len) {
+      sent-=iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt>0) {
+      iov->iov_base=(BYTE_T *)iov->iov_base+sent;
+      iov->iov_len-=sent;
+    }
+  }
+  return done;
+}
+
+void ZeroFrom(const vector<struct iovec> &iov, SIZE_T from)
+{
+  for (vector<struct iovec>::const_iterator i=iov.begin(); i!=iov.end(); ++i) {
+    if (from<(*i).iov_len) {
+      memset((BYTE_T *)(*i).iov_base+from,0,(*i).iov_len-from);
+      from=0;
+    } else {
+      from-=(*i).iov_len;
+    }
+  }
+}
+
+// What came back, got bytes or -errno, decides the result
+static void Finish(IORequest &r, const ssize_t got)
+{
+  if (got<0) {
+    r.result=ERROR_IMPLBUG;
+  } else if ((SIZE_T)got<r.bytes) {
+    if (r.write) {
+      r.result=ERROR_IMPLBUG;
+    } else {
+      ZeroFrom(r.iov,got);
+    }
+  }
+}
+
+
+AsyncIO *AsyncIO::Create(const int fd, const SIZE_T depth, const bool forcethreads)
+{
+  AsyncIO *a=0;
+
+  if (!forcethreads) {
+    a=UringIO::Create(fd,depth);
+  }
+  if (!a) {
+    a=new ThreadPoolIO(fd,depth);
+  }
+  return a;
+}
+
+
+ThreadPoolIO::ThreadPoolIO(const int f, const SIZE_T d) :
+  fd(f), depth(d>0 ? d : 1), inflight(0), stopping(false)
+{
+  for (SIZE_T i=0; i<depth; i++) {
+    workers.push_back(thread(&ThreadPoolIO::Worker,this));
+  }
+}
+
+ThreadPoolIO::~ThreadPoolIO()
+{
+  Drain();
+  {
+    lock_guard<mutex> l(latch);
+    stopping=true;
+  }
+  work.notify_all();
+  for (vector<thread>::iterator i=workers.begin(); i!=workers.end(); ++i) {
+    (*i).join();
+  }
+}
+
+void ThreadPoolIO::Worker()
+{
+  unique_lock<mutex> l(latch);
+
+  while (true) {
+    while (queue.empty() && !stopping) {
+      work.wait(l);
+    }
+    if (queue.empty()) {
+      return;
+    }
+    IOHandle r=queue.front();
+    queue.pop_front();
+    l.unlock();
+
+    vector<struct iovec> left(r->iov);
+    SIZE_T got = r->write ? PwritevAll(fd,r->offset,&left[0],left.size())
+                          : PreadvAll(fd,r->offset,&left[0],left.size());
+    Finish(*r,got);
+    // before anyone waiting can move on, eg, free the callback's object
+    if (r->callback) {
+      r->callback(*r);
+    }
+
+    l.lock();
+    r->done=true;
+    inflight--;
+    finished.notify_all();
+  }
+}
+
+ERROR_T ThreadPoolIO::Submit(const IOHandle &r)
+{
+  unique_lock<mutex> l(latch);
+
+  while (inflight>=depth) {
+    finished.wait(l);
+  }
+  inflight++;
+  queue.push_back(r);
+  work.notify_one();
+  return ERROR_NOERROR;
+}
+
+void ThreadPoolIO::Wait(const IOHandle &r)
+{
+  unique_lock<mutex> l(latch);
+
+  while (!r->done) {
+    finished.wait(l);
+  }
+}
+
+void ThreadPoolIO::Drain()
+{
+  unique_lock<mutex> l(latch);
+
+  while (inflight>0) {
+    finished.wait(l);
+  }
+}
+
+
+// The rings are shared with the kernel, so the indices are read
+// with acquire and published with release
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p),__ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p,v)  __atomic_store_n((p),(v),__ATOMIC_RELEASE)
+
+static int uring_setup(const unsigned entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup,entries,p);
+}
+
+static int uring_enter(const int fd, const unsigned submit, const unsigned complete, const unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter,fd,submit,complete,flags,0,0);
+}
+
+UringIO::UringIO(const int f, const SIZE_T d) :
+  fd(f), ringfd(-1), depth(d>0 ? d : 1), inflight(0),
+  sqring(MAP_FAILED), cqring(MAP_FAILED), sqes(MAP_FAILED),
+  sqringbytes(0), cqringbytes(0), sqesbytes(0)
+{
+}
+
+UringIO *UringIO::Create(const int fd, const SIZE_T depth)
+{
+  UringIO *u=new UringIO(fd,depth);
+
+  if (!u->Setup()) {
+    delete u;
+    return 0;
+  }
+  return u;
+}
+
+bool UringIO::Setup()
+{
+  struct io_uring_params p;
+
+  memset(&p,0,sizeof(p));
+  if ((ringfd=uring_setup(depth,&p))<0) {
+    return false;
+  }
+  // the kernel rounds up to a power of two
+  depth=p.sq_entries;
+
+  sqringbytes=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  cqringbytes=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sqringbytes=cqringbytes=(sqringbytes>cqringbytes ? sqringbytes : cqringbytes);
+  }
+  sqring=mmap(0,sqringbytes,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQ_RING);
+  if (sqring==MAP_FAILED) {
+    return false;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cqring=sqring;
+  } else {
+    cqring=mmap(0,cqringbytes,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_CQ_RING);
+    if (cqring==MAP_FAILED) {
+      return false;
+    }
+  }
+  sqesbytes=p.sq_entries*sizeof(struct io_uring_sqe);
+  sqes=mmap(0,sqesbytes,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQES);
+  if (sqes==MAP_FAILED) {
+    return false;
+  }
+
+  sqhead=(unsigned *)((char *)sqring+p.sq_off.head);
+  sqtail=(unsigned *)((char *)sqring+p.sq_off.tail);
+  sqmask=(unsigned *)((char *)sqring+p.sq_off.ring_mask);
+  sqarray=(unsigned *)((char *)sqring+p.sq_off.array);
+  cqhead=(unsigned *)((char *)cqring+p.cq_off.head);
+  cqtail=(unsigned *)((char *)cqring+p.cq_off.tail);
+  cqmask=(unsigned *)((char *)cqring+p.cq_off.ring_mask);
+  cqes=(char *)cqring+p.cq_off.cqes;
+  return true;
+}
+
+UringIO::~UringIO()
+{
+  if (ringfd>=0) {
+    Drain();
+  }
+  if (sqes!=MAP_FAILED) {
+    munmap(sqes,sqesbytes);
+  }
+  if (cqring!=MAP_FAILED && cqring!=sqring) {
+    munmap(cqring,cqringbytes);
+  }
+  if (sqring!=MAP_FAILED) {
+    munmap(sqring,sqringbytes);
+  }
+  if (ringfd>=0) {
+    close(ringfd);
+  }
+}
+
+// Drops the first n bytes of iov
+static void UseUp(vector<struct iovec> &iov, SIZE_T n)
+{
+  vector<struct iovec>::iterator i=iov.begin();
+
+  while (i!=iov.end() && n>=(*i).iov_len) {
+    n-=(*i).iov_len;
+    ++i;
+  }
+  i=iov.erase(iov.begin(),i);
+  if (i!=iov.end()) {
+    (*i).iov_base=(BYTE_T *)(*i).iov_base+n;
+    (*i).iov_len-=n;
+  }
+}
+
+bool UringIO::Queue(Pending *p)
+{
+  unsigned tail=*sqtail;
+  unsigned index=tail & *sqmask;
+  struct io_uring_sqe *sqe=(struct io_uring_sqe *)sqes+index;
+
+  memset(sqe,0,sizeof(*sqe));
+  sqe->opcode = p->r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd=fd;
+  sqe->addr=(uintptr_t)&p->left[0];
+  // more than IOV_MAX comes back short, and the rest goes again
+  sqe->len = p->left.size()<IOV_MAX ? p->left.size() : IOV_MAX;
+  sqe->off=p->r->offset+p->moved;
+  sqe->user_data=(uintptr_t)p;
+  sqarray[index]=index;
+  STORE_RELEASE(sqtail,tail+1);
+
+  int n;
+  while ((n=uring_enter(ringfd,1,0,0))<0 && errno==EINTR) {
+  }
+  if (n!=1) {
+    // never got to the kernel, so take it back
+    STORE_RELEASE(sqtail,tail);
+    return false;
+  }
+  return true;
+}
+
+void UringIO::Reap(const bool block, vector<IOHandle> &done)
+{
+  if (block && inflight>0) {
+    while (uring_enter(ringfd,0,1,IORING_ENTER_GETEVENTS)<0 && errno==EINTR) {
+    }
+  }
+
+  unsigned head=*cqhead;
+  unsigned tail=LOAD_ACQUIRE(cqtail);
+
+  for (; head!=tail; head++) {
+    struct io_uring_cqe *cqe=(struct io_uring_cqe *)cqes+(head & *cqmask);
+    Pending *p=(Pending *)(uintptr_t)cqe->user_data;
+    int res=cqe->res;
+
+    if (res>0 && p->moved+res<p->r->bytes) {
+      // short of the end of the file, so the rest goes again
+      p->moved+=res;
+      UseUp(p->left,res);
+      if (Queue(p)) {
+	continue;
+      }
+      res=-EIO;
+    }
+    Finish(*p->r, res<0 ? (ssize_t)res : (ssize_t)(p->moved+res));
+    inflight--;
+    reaped.insert(p->r.get());
+    done.push_back(p->r);
+    delete p;
+  }
+  STORE_RELEASE(cqhead,head);
+}
+
+// Like ThreadPoolIO, a request is done only once its callback has run
+void UringIO::RunCallbacks(vector<IOHandle> &done)
+{
+  if (done.empty()) {
+    return;
+  }
+  for (vector<IOHandle>::const_iterator i=done.begin(); i!=done.end(); ++i) {
+    if ((*i)->callback) {
+      (*i)->callback(**i);
+    }
+  }
+  {
+    lock_guard<mutex> l(latch);
+    for (vector<IOHandle>::const_iterator i=done.begin(); i!=done.end(); ++i) {
+      (*i)->done=true;
+      reaped.erase((*i).get());
+    }
+  }
+  finished.notify_all();
+  done.clear();
+}
+
+ERROR_T UringIO::Submit(const IOHandle &r)
+{
+  vector<IOHandle> done;
+  ERROR_T rc=ERROR_NOERROR;
+
+  {
+    lock_guard<mutex> l(latch);
+
+    while (inflight>=depth) {
+      Reap(true,done);
+    }
+
+    // the ring holds it until the completion is reaped
+    Pending *p=new Pending(r);
+    if (Queue(p)) {
+      inflight++;
+    } else {
+      delete p;
+      r->result=rc=ERROR_IMPLBUG;
+      reaped.insert(r.get());
+      done.push_back(r);
+    }
+  }
+  RunCallbacks(done);
+  return rc;
+}
+
+void UringIO::Wait(const IOHandle &r)
+{
+  unique_lock<mutex> l(latch);
+
+  while (!r->done) {
+    if (reaped.count(r.get())) {
+      // another thread is running its callback
+      finished.wait(l);
+      continue;
+    }
+    vector<IOHandle> done;
+    Reap(true,done);
+    l.unlock();
+    RunCallbacks(done);
+    l.lock();
+  }
+}
+
+void UringIO::Drain()
+{
+  unique_lock<mutex> l(latch);
+
+  while (inflight>0 || !reaped.empty()) {
+    if (inflight==0) {
+      finished.wait(l);
+      continue;
+    }
+    vector<IOHandle> done;
+    Reap(true,done);
+    l.unlock();
+    RunCallbacks(done);
+    l.lock();
+  }
+}
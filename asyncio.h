@@ -0,0 +1,163 @@
+#ifndef _asyncio
+#define _asyncio
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <set>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// Positioned I/O straight on a descriptor.  Short transfers are
+// picked up where they left off, so these only come up short at end
+// of file or on an error.  The iovecs are used up along the way.
+// Return the number of bytes moved.
+//
+SIZE_T PreadvAll(const int fd, off_t off, struct iovec *iov, int iovcnt);
+SIZE_T PwritevAll(const int fd, off_t off, struct iovec *iov, int iovcnt);
+// Zero the iovecs from byte from on, eg, what a read past the end
+// of the file did not fill in
+void   ZeroFrom(const vector<struct iovec> &iov, SIZE_T from);
+
+
+//
+// One read or write of a run of consecutive bytes, each iovec a
+// block, in flight while done is false
+//
+struct IORequest {
+  bool     write;
+  off_t    offset;
+  vector<struct iovec> iov;
+  SIZE_T   bytes;       // all of the iovecs
+  ERROR_T  result;
+  bool     done;
+  // Run once the transfer is over, by whichever thread notices, with
+  // no lock of the backend's held.  done is set only after it has
+  // run, with either backend.
+  function<void(const IORequest &)> callback;
+
+  IORequest(const bool w, const off_t off) : write(w), offset(off), bytes(0),
+    result(ERROR_NOERROR), done(false) {}
+};
+
+typedef shared_ptr<IORequest> IOHandle;
+
+
+//
+// Real I/O on the data file with many requests in flight at once
+//
+// Submit returns as soon as the request is queued, and at most
+// depth requests are in flight; Submit waits for one to finish
+// when there are that many.  Reads past the end of the file come
+// back as zeros, as they do for DiskSystem.
+//
+// io_uring is used where the kernel has it, and otherwise a pool
+// of depth threads doing preadv/pwritev.  Both are safe to use from
+// several threads.
+//
+class AsyncIO {
+ public:
+  virtual ~AsyncIO() {}
+
+  virtual ERROR_T Submit(const IOHandle &r)=0;
+  // Until r is done
+  virtual void    Wait(const IOHandle &r)=0;
+  // Until nothing is in flight
+  virtual void    Drain()=0;
+  virtual SIZE_T  GetDepth() const=0;
+  virtual const char *GetName() const=0;
+
+  // io_uring if possible (and not forcethreads), otherwise threads
+  // returns 0 only if neither can be had
+  static AsyncIO *Create(const int fd, const SIZE_T depth, const bool forcethreads=false);
+};
+
+
+class ThreadPoolIO : public AsyncIO {
+ private:
+  int fd;
+  SIZE_T depth;
+  mutex latch;
+  condition_variable work, finished;
+  deque<IOHandle> queue;
+  SIZE_T inflight;       // queued or being done
+  bool stopping;
+  vector<thread> workers;
+
+  void Worker();
+ public:
+  ThreadPoolIO(const int fd, const SIZE_T depth);
+  ~ThreadPoolIO();
+
+  ERROR_T Submit(const IOHandle &r);
+  void    Wait(const IOHandle &r);
+  void    Drain();
+  SIZE_T  GetDepth() const { return depth; }
+  const char *GetName() const { return "threads"; }
+};
+
+
+//
+// Talks to the kernel with the raw system calls, so no liburing is
+// needed.  Completions are reaped by whoever waits.  A transfer that
+// comes up short is sent again for the rest, so reads are only zero
+// filled past the end of the file.
+//
+class UringIO : public AsyncIO {
+ private:
+  // what the ring holds for a request: what is left of it
+  struct Pending {
+    IOHandle r;
+    vector<struct iovec> left;
+    SIZE_T   moved;
+
+    Pending(const IOHandle &h) : r(h), left(h->iov), moved(0) {}
+  };
+
+  int fd;
+  int ringfd;
+  SIZE_T depth;
+  mutex latch;
+  condition_variable finished;
+  SIZE_T inflight;
+  set<IORequest *> reaped;   // done but for their callbacks
+
+  void   *sqring, *cqring, *sqes;
+  size_t  sqringbytes, cqringbytes, sqesbytes;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  void   *cqes;
+
+  UringIO(const int fd, const SIZE_T depth);
+  bool   Setup();
+  // Puts p on the ring; false if the kernel would not take it.
+  // Call with latch held.
+  bool   Queue(Pending *p);
+  // Finishes whatever has completed; with block, waits for at
+  // least one first.  Call with latch held, callbacks go in done.
+  void   Reap(const bool block, vector<IOHandle> &done);
+  // Call without latch held
+  void   RunCallbacks(vector<IOHandle> &done);
+ public:
+  ~UringIO();
+  // returns 0 if the kernel does not do io_uring
+  static UringIO *Create(const int fd, const SIZE_T depth);
+
+  ERROR_T Submit(const IOHandle &r);
+  void    Wait(const IOHandle &r);
+  void    Drain();
+  SIZE_T  GetDepth() const { return depth; }
+  const char *GetName() const { return "io_uring"; }
+};
+
+#endif
@@ -0,0 +1,49 @@
+#!/usr/bin/perl -w
+
+#
+# Runs the same sim workload on a small disk with the tools in two
+# directories, eg, a build from before a change and one from after,
+# and prints the best wall clock time of several runs and what sim
+# says about the disk.  The outputs of the two must be the same.
+#
+
+use Time::HiRes qw(time);
+
+$#ARGV>=4 or die "usage: bench.pl olddir newdir keysize valsize num [runs] [cachesize]\n";
+
+($olddir,$newdir,$keysize,$valsize,$num,$runs,$cachesize)=@ARGV;
+$runs=5 if !defined($runs);
+$cachesize=64 if !defined($cachesize);
+
+$pid=$$;
+$input="BENCH.$pid.input";
+($here=$0)=~s|[^/]*$||;
+
+system "perl ${here}gen_test_sequence.pl $keysize $valsize 1 $num > $input";
+
+foreach $dir ($olddir, $newdir) {
+  $best{$dir}=-1;
+  for ($i=0;$i<$runs;$i++) {
+    $disk="BENCH.$pid.disk";
+    system "$dir/makedisk $disk 16384 1024 1 64 256 10 1 .28 > /dev/null 2>&1";
+    $start=time();
+    system "$dir/sim $disk $cachesize < $input > BENCH.$pid.out 2> BENCH.$pid.err";
+    $elapsed=time()-$start;
+    $best{$dir}=$elapsed if $best{$dir}<0 || $elapsed<$best{$dir};
+    system "rm -f $disk.config $disk.bitmap $disk.data";
+  }
+  $out{$dir}=`cat BENCH.$pid.out`;
+  $err=`cat BENCH.$pid.err`;
+  ($diskreads{$dir})=($err=~/numdiskreads\s*=\s*(\S+)/);
+  ($diskwrites{$dir})=($err=~/numdiskwrites\s*=\s*(\S+)/);
+  ($simtime{$dir})=($err=~/total time\s*=\s*(\S+)/);
+}
+
+unlink $input, "BENCH.$pid.out", "BENCH.$pid.err";
+
+printf "%-30s %12s %12s %12s %12s\n", "", "wall (s)", "diskreads", "diskwrites", "sim time";
+foreach $dir ($olddir, $newdir) {
+  printf "%-30s %12.3f %12s %12s %12s\n", $dir, $best{$dir}, $diskreads{$dir}, $diskwrites{$dir}, $simtime{$dir};
+}
+printf "wall clock change: %+.1f%%\n", 100*($best{$newdir}-$best{$olddir})/$best{$olddir};
+print $out{$olddir} eq $out{$newdir} ? "outputs are the same\n" : "OUTPUTS DIFFER\n";
@@ -0,0 +1,24 @@
+#!/usr/bin/perl -w
+
+#
+# Runs btree_stress against an existing index with 1, 2, 4, ... up to
+# maxthreads threads and prints the lookups per second of each run,
+# how that compares to one thread, and how many lookups failed.
+#
+
+$#ARGV>=4 or die "usage: bench_stress.pl filestem cachesize numshards lookupsperthread maxkey [maxthreads]\n";
+
+($filestem,$cachesize,$numshards,$numlookups,$maxkey,$maxthreads)=@ARGV;
+$maxthreads=8 if !defined($maxthreads);
+
+$ENV{PATH}.=":.";
+
+printf "%8s %12s %8s %10s\n", "threads", "lookups/s", "scaling", "errors";
+for ($threads=1; $threads<=$maxthreads; $threads*=2) {
+  $err=`btree_stress -s $numshards $filestem $cachesize $threads $numlookups $maxkey 2>&1`;
+  ($rate)=($err=~/lookups\/s\s*=\s*(\S+)/);
+  ($errors)=($err=~/numerrors\s*=\s*(\S+)/);
+  defined($rate) or die "btree_stress failed:\n$err";
+  $base=$rate if $threads==1;
+  printf "%8d %12.0f %7.2fx %10s\n", $threads, $rate, $rate/$base, $errors;
+}
@@ -54,6 +54,9 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
 	buffercache = rhs.buffercache;
 	superblock_index = rhs.superblock_index;
 	superblock = rhs.superblock;
+	for (int i = 0; i < BTREE_NUM_EXTENTS; i++) {
+		extents[i] = rhs.extents[i];
+	}
 }
 
 BTreeIndex::~BTreeIndex()
@@ -69,53 +72,142 @@ BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 }
 
 
-//NOTE: the actual value of N gets changed to the number of the free block
-ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
+static int ExtentOf(const int nodetype)
+{
+	return nodetype == BTREE_LEAF_NODE ? BTREE_LEAF_EXTENT : BTREE_UPPER_EXTENT;
+}
+
+ERROR_T BTreeIndex::ReserveExtent(const int kind, const SIZE_T near)
 {
-	n = superblock.info.freelist; //finds a free block for us to unserialize
+	BTreeExtent &e = extents[kind];
+	SIZE_T from = near ? near + 1 : e.end;
+	SIZE_T b;
 
-	if (n == 0) {
-		return ERROR_NOSPACE;
+	if (from >= buffercache->GetNumBlocks()) {
+		from = 0;
 	}
+	// the biggest run there is, up to BTREE_EXTENT_BLOCKS, looking
+	// from where we are and then from the start of the disk.  The
+	// other kind's extent is claimed already, so it is never in a run.
+	for (SIZE_T want = BTREE_EXTENT_BLOCKS; want > 0; want /= 2) {
+		if (buffercache->FindFreeBlocks(want, b, from) == ERROR_NOERROR ||
+			buffercache->FindFreeBlocks(want, b, 0) == ERROR_NOERROR) {
+			e.next = b;
+			e.end = b + want;
+			return buffercache->NotifyAllocateBlock(b, want); //one bitmap update for the whole extent
+		}
+	}
+	return ERROR_NOSPACE;
+}
 
-	BTreeNode node;
-	node.Unserialize(buffercache, n); //read this particular block numberfrom the buffer cahce, (and memory if its not there)
-	//reads the block number to node
+void BTreeIndex::ReleaseExtents()
+{
+	for (int i = 0; i < BTREE_NUM_EXTENTS; i++) {
+		if (extents[i].next < extents[i].end) {
+			buffercache->NotifyDeallocateBlock(extents[i].next, extents[i].end - extents[i].next);
+		}
+		extents[i] = BTreeExtent();
+	}
+}
 
-	assert(node.info.nodetype == BTREE_UNALLOCATED_BLOCK); //will break the operation if this is already an unallocated block
+bool BTreeIndex::HoldsNode(const SIZE_T block)
+{
+	BYTE_T *frame;
+	NodeMetadata info;
 
-	superblock.info.freelist = node.info.freelist; //As this block becomes ready to allocate, the next free block gets put into superblock
+	// each extent block is looked at once, so keep it out of the way of the upper levels
+	if (buffercache->PinBlock(block, frame, true, ACCESS_SEQUENTIAL_ONCE)) {
+		return true; //when in doubt, keep it
+	}
+	info.Unpack(frame);
+	buffercache->UnpinBlock(block);
 
-	superblock.Serialize(buffercache, superblock_index); //now we write it back to memory
+	return (info.nodetype == BTREE_ROOT_NODE || info.nodetype == BTREE_INTERIOR_NODE || info.nodetype == BTREE_LEAF_NODE)
+		&& info.blocksize == buffercache->GetBlockSize();
+}
 
-	buffercache->NotifyAllocateBlock(n); //allocates block n on the buffer
+ERROR_T BTreeIndex::Recover()
+{
+	SuperblockData *sb = superblock.ResolveSuper();
+	ERROR_T rc;
 
+	for (int i = 0; i < BTREE_NUM_EXTENTS; i++) {
+		for (SIZE_T b = sb->extents[i].next; b < sb->extents[i].end && b < buffercache->GetNumBlocks(); b++) {
+			if (!buffercache->IsBlockAllocated(b)) {
+				continue;
+			}
+			if (HoldsNode(b)) {
+				//handed out after the checkpoint
+				if (b >= sb->highwater) {
+					sb->highwater = b + 1;
+				}
+				continue;
+			}
+			rc = buffercache->NotifyDeallocateBlock(b);
+			if (rc) { return rc; }
+		}
+		sb->extents[i] = BTreeExtent();
+	}
 	return ERROR_NOERROR;
 }
 
-
-ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
+//NOTE: the actual value of N gets changed to the number of the free block
+ERROR_T BTreeIndex::AllocateNode(SIZE_T &n, const int nodetype, const SIZE_T near)
 {
-	BTreeNode node;
-
-	node.Unserialize(buffercache, n);
+	int kind = ExtentOf(nodetype);
+	BTreeExtent &e = extents[kind];
+	ERROR_T rc;
 
-	assert(node.info.nodetype != BTREE_UNALLOCATED_BLOCK);
+	if (near != 0 && near + 1 < buffercache->GetNumBlocks() && !buffercache->IsBlockAllocated(near + 1)) {
+		n = near + 1; //a new sibling lands right after the node it came from
+		rc = buffercache->NotifyAllocateBlock(n);
+		if (rc) {
+			return rc;
+		}
+	} else {
+		//the extent's blocks are claimed already, so nothing else can take them
+		if (e.next == e.end) {
+			rc = ReserveExtent(kind, near);
+			if (rc) {
+				return rc;
+			}
+		}
+		n = e.next++;
+	}
+	if (n >= superblock.ResolveSuper()->highwater) {
+		superblock.ResolveSuper()->highwater = n + 1;
+	}
 
-	node.info.nodetype = BTREE_UNALLOCATED_BLOCK;
+	//the block is ours to overwrite, so there is no need to read it first
+	BTreeNode node(BTREE_UNALLOCATED_BLOCK,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize(),
+		superblock.info.format);
 
-	node.info.freelist = superblock.info.freelist; //this points to the next free block now
+	return node.Serialize(buffercache, n);
+}
 
-	node.Serialize(buffercache, n);
 
-	superblock.info.freelist = n; //super node points to this specific node
+ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
+{
+	ERROR_T rc;
 
-	superblock.Serialize(buffercache, superblock_index);
+	assert(buffercache->IsBlockAllocated(n));
 
-	buffercache->NotifyDeallocateBlock(n);
+	//nothing in it is wanted, so it is overwritten without being read
+	BTreeNode node(BTREE_UNALLOCATED_BLOCK,
+		superblock.info.keysize,
+		superblock.info.valuesize,
+		buffercache->GetBlockSize(),
+		superblock.info.format);
 
-	return ERROR_NOERROR;
+	rc = node.Serialize(buffercache, n);
+	if (rc) {
+		return rc;
+	}
 
+	return buffercache->NotifyDeallocateBlock(n); //and the bitmap has it free again
 }
 
 ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
@@ -125,19 +217,38 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 	superblock_index = initblock;
 	assert(superblock_index == 0);
 
+	for (int i = 0; i < BTREE_NUM_EXTENTS; i++) {
+		extents[i] = BTreeExtent();
+	}
+
 	if (create) {
-		// build a super block, root node, and a free space list
+		// the narrowest nodes that can point anywhere on the disk
+		int format = buffercache->GetNumBlocks() > UINT32_MAX ? BTREE_FORMAT_64 : BTREE_FORMAT_32;
+
+		// build a super block and a root node
 		//
 		// Superblock at superblock_index
 		// root node at superblock_index+1
-		// free space list for rest
+		// free blocks for the rest, which the disk's bitmap keeps track
+		// of.  Nothing past the root has been written, so creating an
+		// index costs only a pass over the bitmap whatever the size of
+		// the disk.
 		BTreeNode newsuperblock(BTREE_SUPERBLOCK,
 			superblock.info.keysize,
 			superblock.info.valuesize,
-			buffercache->GetBlockSize());
+			buffercache->GetBlockSize(),
+			format);
 		newsuperblock.info.rootnode = superblock_index + 1;
-		newsuperblock.info.freelist = superblock_index + 2;
+		newsuperblock.info.freelist = 0;
 		newsuperblock.info.numkeys = 0;
+		newsuperblock.ResolveSuper()->magic = BTREE_SUPER_MAGIC;
+		newsuperblock.ResolveSuper()->highwater = superblock_index + 2;
+		newsuperblock.ResolveSuper()->clean = 1;
+
+		// whatever an index made here before had is free again
+		rc = buffercache->NotifyDeallocateBlock(superblock_index + 2,
+			buffercache->GetNumBlocks() - (superblock_index + 2));
+		if (rc) { return rc; }
 
 		buffercache->NotifyAllocateBlock(superblock_index);
 
@@ -150,9 +261,10 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 		BTreeNode newrootnode(BTREE_ROOT_NODE,
 			superblock.info.keysize,
 			superblock.info.valuesize,
-			buffercache->GetBlockSize());
+			buffercache->GetBlockSize(),
+			format);
 		newrootnode.info.rootnode = superblock_index + 1;
-		newrootnode.info.freelist = superblock_index + 2;
+		newrootnode.info.freelist = 0;
 		newrootnode.info.numkeys = 0;
 
 		buffercache->NotifyAllocateBlock(superblock_index + 1);
@@ -162,36 +274,72 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 		if (rc) {
 			return rc;
 		}
+	}
 
-		for (SIZE_T i = superblock_index + 2; i < buffercache->GetNumBlocks(); i++) {
-			BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
-				superblock.info.keysize,
-				superblock.info.valuesize,
-				buffercache->GetBlockSize());
-			newfreenode.info.rootnode = superblock_index + 1;
-			newfreenode.info.freelist = ((i + 1) == buffercache->GetNumBlocks()) ? 0 : i + 1;
-
-			rc = newfreenode.Serialize(buffercache, i);
+	// OK, now, mounting the btree is simply a matter of reading the superblock 
 
-			if (rc) {
-				return rc;
-			}
+	rc = superblock.Unserialize(buffercache, initblock);
+	if (rc) { return rc; }
 
+	if (superblock.info.nodetype != BTREE_SUPERBLOCK) {
+		return ERROR_NOTANINDEX;
+	}
+	// an index from before the superblock kept its data may have
+	// written any block, and was left by a detach
+	SuperblockData *sb = superblock.ResolveSuper();
+	if (sb->magic != BTREE_SUPER_MAGIC) {
+		sb->magic = BTREE_SUPER_MAGIC;
+		sb->highwater = buffercache->GetNumBlocks();
+		sb->clean = 1;
+		for (int i = 0; i < BTREE_NUM_EXTENTS; i++) {
+			sb->extents[i] = BTreeExtent();
 		}
 	}
-
-	// OK, now, mounting the btree is simply a matter of reading the superblock 
-
-	return superblock.Unserialize(buffercache, initblock);
+	// the last write of the superblock was a checkpoint, not a detach
+	if (!sb->clean) {
+		return Recover();
+	}
+	return ERROR_NOERROR;
 }
 
 
 ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
 {
+	SuperblockData *sb = superblock.ResolveSuper();
+
+	ReleaseExtents();
+	for (int i = 0; i < BTREE_NUM_EXTENTS; i++) {
+		sb->extents[i] = BTreeExtent();
+	}
+	sb->clean = 1;
+
 	return superblock.Serialize(buffercache, superblock_index);
 }
 
 
+ERROR_T BTreeIndex::Checkpoint()
+{
+	SuperblockData *sb = superblock.ResolveSuper();
+	ERROR_T rc;
+
+	for (int i = 0; i < BTREE_NUM_EXTENTS; i++) {
+		sb->extents[i] = extents[i];
+	}
+	sb->clean = 0;
+
+	// the nodes go out first, so the superblock never points at one
+	// that is only in the cache
+	rc = buffercache->Sync();
+	if (rc) { return rc; }
+
+	rc = superblock.Serialize(buffercache, superblock_index);
+	if (rc) { return rc; }
+
+	// and the bitmap goes out with it
+	return buffercache->FlushBlock(superblock_index);
+}
+
+
 // Interior node:
 //
 // PTR KEY PTR KEY PTR KEY PTR
@@ -523,7 +671,7 @@ ERROR_T BTreeIndex::Split(list<SIZE_T> Hvector){
 		blk2 = orig_node.info.numkeys - blk1 - 1;
 
 
-		rc = AllocateNode(new_block_ref);
+		rc = AllocateNode(new_block_ref, BTREE_INTERIOR_NODE, OGblock_ref);
 		if (rc) { cout << rc << endl; return rc; }
 		rc = new_node.Unserialize(buffercache, new_block_ref);
 		if (rc) { return rc; }
@@ -579,7 +727,7 @@ ERROR_T BTreeIndex::Split(list<SIZE_T> Hvector){
 			SIZE_T TempRoot_loc;
 			SIZE_T& TempRoot_ref = TempRoot_loc;
 			BTreeNode TempRoot;
-			rc = AllocateNode(TempRoot_ref);
+			rc = AllocateNode(TempRoot_ref, BTREE_ROOT_NODE);
 			if (rc) { cout << rc << endl; return rc; }
 			rc = TempRoot.Unserialize(buffercache, TempRoot_ref);
 			if (rc) { return rc; }
@@ -626,7 +774,7 @@ ERROR_T BTreeIndex::Split(list<SIZE_T> Hvector){
 		blk2 = orig_node.info.numkeys / 2;
 		blk1 = orig_node.info.numkeys - blk2;
 
-		rc = AllocateNode(new_block_ref);
+		rc = AllocateNode(new_block_ref, BTREE_LEAF_NODE, OGblock_ref);
 		if (rc) { cout << rc << endl; return rc; }
 		rc = new_node.Unserialize(buffercache, new_block_ref);
 		if (rc) { return rc; }
@@ -793,7 +941,7 @@ ERROR_T BTreeIndex::Inserter(list<SIZE_T> Hvector, const SIZE_T &node, const KEY
 			SIZE_T& RB_ref = RBAdress;
 
 			//we must allocate a new node because there is nothing in root
-			rc = AllocateNode(LB_ref); //puts the node into memory via unserialize in allocate function
+			rc = AllocateNode(LB_ref, BTREE_LEAF_NODE); //puts the node into memory via unserialize in allocate function
 			//LB_ref now becomes the number of a free block within memory, (it is loaded into buffer by the function allocate)
 			if (rc) { 
 				cout << rc << endl; 
@@ -814,7 +962,7 @@ ERROR_T BTreeIndex::Inserter(list<SIZE_T> Hvector, const SIZE_T &node, const KEY
 			if (rc) { return rc; }
 
 			//same thing for the right node
-			rc = AllocateNode(RB_ref);
+			rc = AllocateNode(RB_ref, BTREE_LEAF_NODE, LBAdress);
 			if (rc) { cout << rc << endl; return rc; }
 			BTreeNode right_node;
 			rc = right_node.Unserialize(buffercache, RBAdress);
@@ -928,11 +1076,13 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 {
 	KEY_T testkey;
 	SIZE_T ptr;
+	SIZE_T nextptr;
 	BTreeNode b;
 	ERROR_T rc;
 	SIZE_T offset;
 
-	rc = b.Unserialize(buffercache, node);
+	// a display touches every node once, so keep it out of the way of the working set
+	rc = b.Unserialize(buffercache, node, ACCESS_SEQUENTIAL_ONCE);
 
 	if (rc != ERROR_NOERROR) {
 		return rc;
@@ -960,6 +1110,13 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 				if (display_type == BTREE_DEPTH_DOT) {
 					o << node << " -> " << ptr << ";\n";
 				}
+				// single step prefetch: the next sibling loads while we walk this subtree
+				// it is not sent to the scan ring, where the subtree would recycle it before we get there
+				if (offset < b.info.numkeys) {
+					rc = b.GetPtr(offset + 1, nextptr);
+					if (rc) { return rc; }
+					buffercache->PrefetchBlock(nextptr);
+				}
 				rc = DisplayInternal(ptr, o, display_type);
 				if (rc) { return rc; }
 			}
@@ -1004,6 +1161,10 @@ ERROR_T BTreeIndex::TreeChecker(set<SIZE_T> SeenBefore, const SIZE_T &node) cons
 	SIZE_T& ptr_ref = ptr;
 	SIZE_T offset;
 
+	if (node >= superblock.ResolveSuper()->highwater) {
+		return ERROR_INSANE; //nothing up there has ever been a node
+	}
+
 	if (SeenBefore.count(node)) {
 		return ERROR_INSANE; //if the node is something we've seen. Then we got a faulty tree
 	}
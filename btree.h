@@ -51,10 +51,31 @@ class BTreeIndex {
   BufferCache *buffercache;
   SIZE_T       superblock_index; //index of superblock on the cache
   BTreeNode    superblock;
+  BTreeExtent  extents[BTREE_NUM_EXTENTS];
 
  protected:
 
-  ERROR_T      AllocateNode(SIZE_T &node);
+  // Free blocks are the ones the disk's bitmap says are free.  A
+  // node placed after near (a sibling it was split from) goes in the
+  // block right after it if that is free, and otherwise in the next
+  // block of its level's extent.  The new block holds a fresh
+  // BTREE_UNALLOCATED_BLOCK, so nothing is read from the disk, and
+  // blocks are never set up ahead of time: the superblock's high-water
+  // mark is raised past it, and what is at or above the mark is
+  // whatever the disk had there.  The superblock itself is only
+  // written by Detach and Checkpoint.
+  ERROR_T      AllocateNode(SIZE_T &node, const int nodetype=BTREE_LEAF_NODE, const SIZE_T near=0);
+  // Claims a new extent for kind in the bitmap, as close after near
+  // as it can
+  ERROR_T      ReserveExtent(const int kind, const SIZE_T near);
+  // Gives the blocks of the extents not handed out back to the bitmap
+  void         ReleaseExtents();
+  // Does the block, as it is on the disk, look like a node?
+  bool         HoldsNode(const SIZE_T block);
+  // After a checkpoint that was not followed by a detach, gives back
+  // the blocks of the extents the superblock has that never became
+  // nodes
+  ERROR_T      Recover();
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
@@ -106,6 +127,11 @@ public:
   // We expect you to tell us the number of your superblock, which
   // we will return to you on the next attach
   ERROR_T Detach(SIZE_T &initblock);
+
+  // Writes every dirty node, then the superblock and the bitmap, out
+  // now, keeping the extents.  Attach gives back what they have left if the index is
+  // not detached after this.
+  ERROR_T Checkpoint();
   
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include "btree.h"
+#include "tooloptions.h"
+
+void usage() 
+{
+  cerr << "usage: btree_checkpoint " TOOL_OPTIONS_USAGE " filestem cachesize fill|check numkeys\n";
+}
+
+//
+// fill inserts numkeys keys, checkpoints, and dies on the spot, as if
+// it had crashed, so the index is never detached.  check attaches
+// again, which recovers from the checkpoint, and then checks the
+// index is sane and has all the keys.  Keys and values are decimal
+// numbers zero padded to the index's sizes, as btree_stress has them.
+// They go in in a shuffled order, so the dirty nodes are scattered
+// over the disk rather than in one run next to the superblock.
+//
+static void MakeKey(char *buf, const SIZE_T size, const SIZE_T i)
+{
+  snprintf(buf,size+1,"%0*u",(int)size,(unsigned)i);
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  SIZE_T numkeys;
+  bool fill;
+
+  ToolOptions options;
+
+  if (!options.Parse(argc,argv)) {
+    usage();
+    return -1;
+  }
+
+  if (argc!=5 || (strcmp(argv[3],"fill") && strcmp(argv[3],"check"))) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  fill=!strcmp(argv[3],"fill");
+  numkeys=strtoull(argv[4],0,10);
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize,options.policy);
+  options.Apply(cache);
+  BTreeIndex btree(0,0,&cache);
+  
+  ERROR_T rc;
+
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  }
+  cerr << "Index attached!"<<endl;
+
+  BTreeNode superblock;
+
+  if ((rc=superblock.Unserialize(&cache,0))!=ERROR_NOERROR) {
+    cerr << "Can't read superblock due to error "<<rc<<endl;
+    return -1;
+  }
+  if (superblock.info.keysize>32 || superblock.info.valuesize>32) {
+    cerr << "Keys and values of more than 32 bytes are too long\n";
+    return -1;
+  }
+
+  char key[33], value[33];
+
+  if (fill) {
+    vector<SIZE_T> order(numkeys);
+    for (SIZE_T i=0; i<numkeys; i++) {
+      order[i]=i;
+    }
+    srand(numkeys);
+    for (SIZE_T i=numkeys; i>1; i--) {
+      swap(order[i-1],order[rand()%i]);
+    }
+    for (SIZE_T j=0; j<numkeys; j++) {
+      SIZE_T i=order[j];
+      MakeKey(key,superblock.info.keysize,i);
+      MakeKey(value,superblock.info.valuesize,i);
+      if ((rc=btree.Insert(KEY_T(key),VALUE_T(value)))!=ERROR_NOERROR) {
+	cerr << "Insert of key "<<i<<" failed: error "<<rc<<endl;
+	return -1;
+      }
+    }
+    if ((rc=btree.Checkpoint())!=ERROR_NOERROR) {
+      cerr << "Checkpoint failed: error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Checkpointed "<<numkeys<<" keys, crashing\n";
+    // no detach, and no destructors to write anything else out
+    _exit(0);
+  }
+
+  SIZE_T found=0;
+
+  for (SIZE_T i=0; i<numkeys; i++) {
+    VALUE_T val;
+    MakeKey(key,superblock.info.keysize,i);
+    MakeKey(value,superblock.info.valuesize,i);
+    if (btree.Lookup(KEY_T(key),val)==ERROR_NOERROR && val==VALUE_T(value)) {
+      found++;
+    }
+  }
+  ERROR_T sane=btree.SanityCheck();
+
+  cerr << "sanity          = "<<sane<<endl;
+  cerr << "numfound        = "<<found<<" of "<<numkeys<<endl;
+  cerr << "freeblocks      = "<<disk.GetNumFreeBlocks()<<endl;
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  return sane==ERROR_NOERROR && found==numkeys ? 0 : -1;
+}
@@ -1,9 +1,10 @@
 #include <stdlib.h>
 #include "btree.h"
+#include "tooloptions.h"
 
 void usage() 
 {
-  cerr << "usage: btree_display filestem cachesize dot|normal\n";
+  cerr << "usage: btree_display " TOOL_OPTIONS_USAGE " filestem cachesize dot|normal\n";
 }
 
 
@@ -14,6 +15,13 @@ int main(int argc, char **argv)
   SIZE_T cachesize;
   SIZE_T superblocknum;
 
+  ToolOptions options;
+
+  if (!options.Parse(argc,argv)) {
+    usage();
+    return -1;
+  }
+
   if (argc!=4) { 
     usage();
     return -1;
@@ -24,7 +32,8 @@ int main(int argc, char **argv)
   dot=argv[3][0]=='d' || argv[3][0]=='D';
 
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,cachesize,options.policy);
+  options.Apply(cache);
   BTreeIndex btree(0,0,&cache);
   
   ERROR_T rc;
@@ -65,6 +74,7 @@ int main(int argc, char **argv)
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+    cerr << "memory (bytes)  = "<<cache.GetMemoryUsage()<<endl;
 
     return 0;
   }
@@ -15,25 +15,77 @@
 using namespace std;
 
 
+SIZE_T NodeMetadata::GetNumMetadataBytes() const
+{
+  return format==BTREE_FORMAT_32 ? sizeof(NodeMetadata32) : sizeof(*this);
+}
+
+SIZE_T NodeMetadata::GetNumPtrBytes() const
+{
+  return format==BTREE_FORMAT_32 ? sizeof(uint32_t) : sizeof(SIZE_T);
+}
+
 SIZE_T NodeMetadata::GetNumDataBytes() const
 {
-  SIZE_T n=blocksize-sizeof(*this); ////reveals the number of free bytes minus the node metadata structure
+  SIZE_T n=blocksize-GetNumMetadataBytes(); ////reveals the number of free bytes minus the node metadata structure
   return n;
 }
 
 //size of T for the pointer because its an array of keys
 SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+  return (GetNumDataBytes()-GetNumPtrBytes())/(keysize+GetNumPtrBytes());  // floor intended
 }
 
 SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
+  return (GetNumDataBytes()-GetNumPtrBytes())/(keysize+valuesize);  // floor intended
+}
+
+bool NodeMetadata::IsUpperLevel() const
+{
+  return nodetype==BTREE_ROOT_NODE || nodetype==BTREE_INTERIOR_NODE;
 }
 
 
 
+void NodeMetadata::Pack(BYTE_T *frame) const
+{
+  if (format==BTREE_FORMAT_32) {
+    NodeMetadata32 m;
+    m.nodetype=nodetype;
+    m.keysize=keysize;
+    m.valuesize=valuesize;
+    m.blocksize=blocksize;
+    m.rootnode=rootnode;
+    m.freelist=freelist;
+    m.numkeys=numkeys;
+    memcpy(frame,&m,sizeof(m));
+  } else {
+    memcpy(frame,this,sizeof(*this));
+  }
+}
+
+void NodeMetadata::Unpack(const BYTE_T *frame)
+{
+  NodeMetadata32 m;
+
+  memcpy(&m,frame,sizeof(m));
+  if (m.blocksize==0) {
+    memcpy(this,frame,sizeof(*this));
+  } else {
+    nodetype=m.nodetype;
+    format=BTREE_FORMAT_32;
+    keysize=m.keysize;
+    valuesize=m.valuesize;
+    blocksize=m.blocksize;
+    rootnode=m.rootnode;
+    freelist=m.freelist;
+    numkeys=m.numkeys;
+  }
+}
+
+
 ostream & NodeMetadata::Print(ostream &os) const 
 {
   os << "NodeMetaData(nodetype="<<(nodetype==BTREE_UNALLOCATED_BLOCK ? "UNALLOCATED_BLOCK" :
@@ -41,6 +93,7 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
 				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+     << ", format="<<(format==BTREE_FORMAT_32 ? 32 : 64)
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
      << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
   return os;
@@ -53,6 +106,7 @@ ostream & NodeMetadata::Print(ostream &os) const
 BTreeNode::BTreeNode() 
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK; //upon declaring this will be an unallocated node
+  info.format=BTREE_FORMAT_64;
   data=0;
 }
 
@@ -66,9 +120,10 @@ BTreeNode::~BTreeNode()
 }
 
 
-BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size)
+BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size, int format)
 {
   info.nodetype=node_type;
+  info.format=format;
   info.keysize=key_size;
   info.valuesize=value_size;
   info.blocksize=block_size;
@@ -77,7 +132,7 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.numkeys=0;				       
   data=0;
 
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
     data = new char [info.GetNumDataBytes()]; //new char syntax for a character array
     memset(data,0,info.GetNumDataBytes());
 	//void * memset ( void * ptr, int value, size_t num) //data is the pointer to area in memory, 0 is the value that will be set
@@ -88,6 +143,7 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
 BTreeNode::BTreeNode(const BTreeNode &rhs) //parameter is address to actual node calling this function
 {
   info.nodetype=rhs.info.nodetype;
+  info.format=rhs.info.format;
   info.keysize=rhs.info.keysize;
   info.valuesize=rhs.info.valuesize;
   info.blocksize=rhs.info.blocksize;
@@ -107,39 +163,82 @@ BTreeNode & BTreeNode::operator=(const BTreeNode &rhs)
   return *(new (this) BTreeNode(rhs));
 }
 
+// A 32 bit superblock has the SIZE_Ts of its SuperblockData as 32
+// bit words
+#define SUPERBLOCK_WORDS (sizeof(SuperblockData)/sizeof(SIZE_T))
+
+static void WidenSuper(char *data, const BYTE_T *from)
+{
+  SIZE_T w[SUPERBLOCK_WORDS];
+
+  for (SIZE_T i=0;i<SUPERBLOCK_WORDS;i++) {
+    uint32_t v;
+    memcpy(&v,from+i*sizeof(v),sizeof(v));
+    w[i]=v;
+  }
+  memcpy(data,w,sizeof(w));
+}
+
+static void NarrowSuper(BYTE_T *to, const char *data)
+{
+  SIZE_T w[SUPERBLOCK_WORDS];
+
+  memcpy(w,data,sizeof(w));
+  for (SIZE_T i=0;i<SUPERBLOCK_WORDS;i++) {
+    uint32_t v=w[i];
+    memcpy(to+i*sizeof(v),&v,sizeof(v));
+  }
+}
+
 //writes block to memory/buffer
+//the node is copied straight into the pinned cache frame, no temporary block
 ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 {
   assert((unsigned)info.blocksize==b->GetBlockSize()); //will terminate the serialize there are different block sizes
 
-  Block block(sizeof(info)+info.GetNumDataBytes()); //creates a new temporary block here
+  BYTE_T *frame;
+
+  ERROR_T rc=b->PinBlock(blocknum,frame,false); //we overwrite all of it, so no need to read it first
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  info.Pack(frame); //puts all of the metadate inside of the frame
 
-  memcpy(block.data,&info,sizeof(info)); //puts all of the metadate inside of this created block
+  BYTE_T *framedata=frame+info.GetNumMetadataBytes();
 
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { //for a normal node
-    memcpy(block.data+sizeof(info),data,info.GetNumDataBytes()); //copies this node data into the block, (will never be 0's cause the block cannot be unallocated)
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) { //for a normal node or the superblock
+    memcpy(framedata,data,info.GetNumDataBytes()); //copies this node data into the frame, (will never be 0's cause the block cannot be unallocated)
+    if (info.nodetype==BTREE_SUPERBLOCK && info.format==BTREE_FORMAT_32) {
+      NarrowSuper(framedata,data);
+    }
+  } else {
+    memset(framedata,0,info.GetNumDataBytes());
   }
 
-  return b->WriteBlock(blocknum,block); //write this newly created temprorary block into the buffer, specifying the exact block number
+  b->SetKeepHot(blocknum,info.IsUpperLevel()); // and a freed or split node gives it up
+
+  return b->UnpinBlock(blocknum,true); //and mark it dirty
 
 }
 
 //reads specific block from memory/buffer TO the block that is calling this member function
-ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
+//straight out of the pinned cache frame
+ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum, const AccessHint hint)
 {
-  Block block;
+  BYTE_T *frame;
 
   ERROR_T rc;
 
-  //note that there is a direct memory refernence to input block &
-  rc=b->ReadBlock(blocknum,block); //will read block from memory if it is not in the cache already
+  rc=b->PinBlock(blocknum,frame,true,hint); //will read block from disk if it is not in the cache already
   //this specific buffer cache 'b' will be used in reading
 
   if (rc!=ERROR_NOERROR) {
     return rc;
   }
 
-  memcpy(&info,block.data,sizeof(info));
+  info.Unpack(frame);
   
   if (data) { 
     delete [] data;
@@ -148,12 +247,20 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 
   assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
     data = new char [info.GetNumDataBytes()];
-    memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
+    memcpy(data,frame+info.GetNumMetadataBytes(),info.GetNumDataBytes());
+    if (info.nodetype==BTREE_SUPERBLOCK && info.format==BTREE_FORMAT_32) {
+      WidenSuper(data,frame+info.GetNumMetadataBytes());
+    }
+  }
+
+  if (hint!=ACCESS_SEQUENTIAL_ONCE) {
+    // now that we know what kind of node it is
+    b->SetKeepHot(blocknum,info.IsUpperLevel());
   }
   
-  return ERROR_NOERROR;
+  return b->UnpinBlock(blocknum);
 }
 
 
@@ -166,11 +273,11 @@ char * BTreeNode::ResolveKey(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE: //apparently root nodes are interior nodes!!!
     assert(offset<info.numkeys); // extra sizeofT because its the key, and there are key value pairs stored side by side in memory
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
+    return data+info.GetNumPtrBytes()+offset*(info.GetNumPtrBytes()+info.keysize);
     break;
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    return data+info.GetNumPtrBytes()+offset*(info.keysize+info.valuesize);
     break;
   default:
     return 0;
@@ -185,7 +292,7 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
-    return data+offset*(sizeof(SIZE_T)+info.keysize);
+    return data+offset*(info.GetNumPtrBytes()+info.keysize);
     break;
   case BTREE_LEAF_NODE:
     assert(offset==0);
@@ -203,7 +310,7 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
   switch (info.nodetype) { 
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    return data+info.GetNumPtrBytes()+offset*(info.keysize+info.valuesize)+info.keysize;
     break;
   default:
     return 0;
@@ -216,6 +323,12 @@ char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
   return ResolveKey(offset);
 }
 
+SuperblockData * BTreeNode::ResolveSuper() const
+{
+  assert(info.nodetype==BTREE_SUPERBLOCK);
+  return (SuperblockData *)data;
+}
+
 
 
 
@@ -242,7 +355,13 @@ ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
     return ERROR_NOMEM;
   }
   
-  memcpy(&ptr,p,sizeof(SIZE_T));
+  if (info.format==BTREE_FORMAT_32) {
+    uint32_t p32;
+    memcpy(&p32,p,sizeof(p32));
+    ptr=p32;
+  } else {
+    memcpy(&ptr,p,sizeof(SIZE_T));
+  }
   return ERROR_NOERROR;
 }
 
@@ -294,7 +413,15 @@ ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
     return ERROR_NOMEM;
   }
 
-  memcpy(p,&ptr,sizeof(SIZE_T));
+  if (info.format==BTREE_FORMAT_32) {
+    uint32_t p32=ptr;
+    if (p32!=ptr) { 
+      return ERROR_SIZE; //a 32 bit index can not point past 2^32
+    }
+    memcpy(p,&p32,sizeof(p32));
+  } else {
+    memcpy(p,&ptr,sizeof(SIZE_T));
+  }
 
   return ERROR_NOERROR;
 }
@@ -332,6 +459,9 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 ostream & BTreeNode::Print(ostream &os) const 
 {
   os << "BTreeNode(info="<<info;
+  if (info.nodetype==BTREE_SUPERBLOCK) {
+    os <<", highwater="<<ResolveSuper()->highwater;
+  }
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
     os <<", ";
     if (info.nodetype==BTREE_INTERIOR_NODE || info.nodetype==BTREE_ROOT_NODE) {
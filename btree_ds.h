@@ -4,6 +4,7 @@
 #include <iostream>
 #include "global.h"
 #include "block.h"
+#include "buffercache.h" // for AccessHint
 
 using namespace std;
 
@@ -26,25 +27,55 @@ class BufferCache; //already defined in buffercache.h with the following members
 // private:
 //DiskSystem *disk;
 //SIZE_T cachesize;
-//map<SIZE_T, Block, cache_compare_lessthan> blockmap;
+//unordered_map<SIZE_T, BufferFrame *> blockmap;
 //double curtime;
 //SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
 
 struct KeyValuePair;
 
+// Layouts of a node on the disk.  An index on a disk of up to 2^32
+// blocks has 32 bit metadata and pointers in all its nodes, as every
+// index did while block numbers were 32 bits, so it packs as many keys
+// in a node as ever.  An index on a bigger disk is 64 bit.  A 64 bit
+// node has its metadata as NodeMetadata is, a 32 bit one as
+// NodeMetadata32.
+#define BTREE_FORMAT_32 1
+#define BTREE_FORMAT_64 2
+
+struct NodeMetadata32 {
+  int nodetype;
+  uint32_t keysize;
+  uint32_t valuesize;
+  uint32_t blocksize;
+  uint32_t rootnode;
+  uint32_t freelist;
+  uint32_t numkeys;
+};
+
 struct NodeMetadata {
   int nodetype;
+  int format; //BTREE_FORMAT_*
   SIZE_T keysize; 
   SIZE_T valuesize; //should remain constant but can be changed for extra credit\
 
   SIZE_T blocksize; //note this is to be declared in the construction of BTreeNode
   SIZE_T rootnode; //meaningful only for superblock
-  SIZE_T freelist; //meaningful only for superblock or a free block
+  SIZE_T freelist; //no longer used, free blocks are the ones the disk's bitmap says are free
   SIZE_T numkeys;
 
+  SIZE_T GetNumMetadataBytes() const; //on the disk
+  SIZE_T GetNumPtrBytes() const;
   SIZE_T GetNumDataBytes() const;
   SIZE_T GetNumSlotsAsInterior() const; //returns number of available slots for keyPTR pairs within a specific node
   SIZE_T GetNumSlotsAsLeaf() const;
+  // superblock, root and interior nodes are read on every lookup,
+  // so the cache is asked to keep them
+  bool   IsUpperLevel() const;
+  // To and from the start of a block, in the block's format.  A 32
+  // bit block has its blocksize where a 64 bit one has the high half
+  // of its keysize, which is never set, so Unpack can tell them apart.
+  void   Pack(BYTE_T *frame) const;
+  void   Unpack(const BYTE_T *frame);
 
   ostream &Print(ostream &rhs) const;
 			  
@@ -65,12 +96,45 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // *Here this pointer is not used
 
+// Nodes are handed out from extents of up to this many neighboring
+// free blocks, one extent for the leaf level and one for the levels
+// above it, so that a range scan reads leaves in runs instead of
+// seeking for each.  A whole extent is claimed in the bitmap when it
+// is set aside.
+#define BTREE_EXTENT_BLOCKS 16
+#define BTREE_LEAF_EXTENT   0
+#define BTREE_UPPER_EXTENT  1
+#define BTREE_NUM_EXTENTS   2
+
+// Blocks next to hand out are next up to end; next==end when empty
+struct BTreeExtent {
+  SIZE_T next;
+  SIZE_T end;
+
+  BTreeExtent() : next(0), end(0) {}
+};
+
+// Marks a superblock that keeps a SuperblockData.  Superblocks written
+// before it kept anything have whatever was in memory there instead.
+#define BTREE_SUPER_MAGIC 0x42545344
+
+// What the superblock keeps in its data.  A 32 bit superblock has each
+// field in 32 bits.
+struct SuperblockData {
+  SIZE_T magic;     //BTREE_SUPER_MAGIC, or the superblock predates it
+  SIZE_T highwater; //no block at or above it has ever held a node
+  SIZE_T clean;     //1 if written by Detach, 0 if by a checkpoint
+  BTreeExtent extents[BTREE_NUM_EXTENTS]; //claimed but not handed out at the checkpoint
+};
+
+
 //each node with have a certain amout of key values (blocks) mapped into its memory or *data in this case)
 struct BTreeNode {
   NodeMetadata  info; //each tree node has this information appended to it
   char         *data; //A pointer to the actual bytes associated with it
   //
-  // unallocated or superblock => blank
+  // unallocated => blank
+  // superblock => SuperblockData, then blank
   // interior => array of keys
   // leaf => array of key/value pairs
 
@@ -85,12 +149,12 @@ struct BTreeNode {
   ~BTreeNode(); //is executed whenever an object of it's class goes out of scope (program closes)
 				//or whenever the delete expression is applied to a pointer to the object of that class
 
-  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size);
+  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size, int format=BTREE_FORMAT_64);
   BTreeNode(const BTreeNode &rhs);
   BTreeNode & operator=(const BTreeNode &rhs);
   
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
-  ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
+  ERROR_T Unserialize(BufferCache *b, const SIZE_T block, const AccessHint hint=ACCESS_NORMAL);
 
   // NOTE To simplify our lives, we will just treat a Key or Value as being the same as a block
   //these function will be called from a target block
@@ -98,6 +162,7 @@ struct BTreeNode {
   char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
   char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
   char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
+  SuperblockData *ResolveSuper() const; // Gives a pointer to the superblock's data (superblock)
 
 
 
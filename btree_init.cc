@@ -1,10 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "btree.h"
+#include "tooloptions.h"
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init " TOOL_OPTIONS_USAGE " filestem cachesize keysize valuesize\n";
 }
 
 
@@ -14,6 +15,13 @@ int main(int argc, char **argv)
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
 
+  ToolOptions options;
+
+  if (!options.Parse(argc,argv)) {
+    usage();
+    return -1;
+  }
+
   if (argc!=5) { 
     usage();
     return -1;
@@ -25,7 +33,8 @@ int main(int argc, char **argv)
   valuesize=atoi(argv[4]);
 
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,cachesize,options.policy);
+  options.Apply(cache);
   BTreeIndex btree(keysize,valuesize,&cache);
   
   ERROR_T rc;
@@ -59,6 +68,7 @@ int main(int argc, char **argv)
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+    cerr << "memory (bytes)  = "<<cache.GetMemoryUsage()<<endl;
 
     return 0;
   }
@@ -1,9 +1,10 @@
 #include <stdlib.h>
 #include "btree.h"
+#include "tooloptions.h"
 
 void usage() 
 {
-  cerr << "usage: btree_insert filestem cachesize key value\n";
+  cerr << "usage: btree_insert " TOOL_OPTIONS_USAGE " filestem cachesize key value\n";
 }
 
 
@@ -14,6 +15,13 @@ int main(int argc, char **argv)
   SIZE_T superblocknum;
   char *key, *value;
 
+  ToolOptions options;
+
+  if (!options.Parse(argc,argv)) {
+    usage();
+    return -1;
+  }
+
   if (argc!=5) { 
     usage();
     return -1;
@@ -25,7 +33,8 @@ int main(int argc, char **argv)
   value=argv[4];
 
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,cachesize,options.policy);
+  options.Apply(cache);
   BTreeIndex btree(0,0,&cache);
   
   ERROR_T rc;
@@ -64,6 +73,7 @@ int main(int argc, char **argv)
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+    cerr << "memory (bytes)  = "<<cache.GetMemoryUsage()<<endl;
 
     return 0;
   }
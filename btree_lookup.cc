@@ -1,9 +1,10 @@
 #include <stdlib.h>
 #include "btree.h"
+#include "tooloptions.h"
 
 void usage() 
 {
-  cerr << "usage: btree_lookup filestem cachesize key\n";
+  cerr << "usage: btree_lookup " TOOL_OPTIONS_USAGE " filestem cachesize key\n";
 }
 
 
@@ -14,6 +15,13 @@ int main(int argc, char **argv)
   SIZE_T superblocknum;
   char *key;
 
+  ToolOptions options;
+
+  if (!options.Parse(argc,argv)) {
+    usage();
+    return -1;
+  }
+
   if (argc!=4) { 
     usage();
     return -1;
@@ -24,7 +32,8 @@ int main(int argc, char **argv)
   key=argv[3];
 
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,cachesize,options.policy);
+  options.Apply(cache);
   BTreeIndex btree(0,0,&cache);
   
   ERROR_T rc;
@@ -66,6 +75,7 @@ int main(int argc, char **argv)
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+    cerr << "memory (bytes)  = "<<cache.GetMemoryUsage()<<endl;
 
     return 0;
   }
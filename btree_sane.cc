@@ -1,9 +1,10 @@
 #include <stdlib.h>
 #include "btree.h"
+#include "tooloptions.h"
 
 void usage() 
 {
-  cerr << "usage: btree_sane filestem cachesize\n";
+  cerr << "usage: btree_sane " TOOL_OPTIONS_USAGE " filestem cachesize\n";
 }
 
 
@@ -13,6 +14,13 @@ int main(int argc, char **argv)
   SIZE_T cachesize;
   SIZE_T superblocknum;
 
+  ToolOptions options;
+
+  if (!options.Parse(argc,argv)) {
+    usage();
+    return -1;
+  }
+
   if (argc!=3) { 
     usage();
     return -1;
@@ -22,7 +30,8 @@ int main(int argc, char **argv)
   cachesize=atoi(argv[2]);
 
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,cachesize,options.policy);
+  options.Apply(cache);
   BTreeIndex btree(0,0,&cache);
   
   ERROR_T rc;
@@ -63,6 +72,7 @@ int main(int argc, char **argv)
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+    cerr << "memory (bytes)  = "<<cache.GetMemoryUsage()<<endl;
 
     return 0;
   }
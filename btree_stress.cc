@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "btree.h"
+#include "tooloptions.h"
+
+void usage()
+{
+  cerr << "usage: btree_stress " TOOL_OPTIONS_USAGE " [-s numshards] filestem cachesize numthreads lookupsperthread maxkey\n";
+}
+
+//
+// Each thread looks up random keys below maxkey, written as decimal
+// numbers zero padded to the index's key size, so some are there
+// and some are not
+//
+struct StressThread {
+  BTreeIndex *btree;
+  SIZE_T      numlookups;
+  SIZE_T      maxkey;
+  SIZE_T      keysize;
+  unsigned    seed;
+  SIZE_T      found;
+  SIZE_T      errors;
+
+  void operator()() {
+    char key[64];
+    found=errors=0;
+    for (SIZE_T i=0; i<numlookups; i++) {
+      VALUE_T val;
+      snprintf(key,sizeof(key),"%0*u",(int)keysize,(unsigned)(rand_r(&seed)%maxkey));
+      ERROR_T rc=btree->Lookup(KEY_T(key),val);
+      if (rc==ERROR_NOERROR) {
+	found++;
+      } else if (rc!=ERROR_NONEXISTENT) {
+	errors++;
+      }
+    }
+  }
+};
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize, numthreads, numlookups, maxkey;
+  SIZE_T superblocknum;
+
+  ToolOptions options;
+  SIZE_T numshards=1;
+
+  function<bool(const int, const char *)> stressoptions=[&](const int opt, const char *arg) {
+    numshards=atoi(arg);
+    return true;
+  };
+
+  if (!options.Parse(argc,argv,"s:",stressoptions)) {
+    usage();
+    return -1;
+  }
+
+  if (argc!=6) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  numthreads=atoi(argv[3]);
+  numlookups=atoi(argv[4]);
+  maxkey=atoi(argv[5]);
+
+  if (numthreads<1 || maxkey<1) {
+    usage();
+    return -1;
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize,options.policy,numshards);
+  options.Apply(cache);
+  BTreeIndex btree(0,0,&cache);
+
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  }
+  cerr << "Index attached!"<<endl;
+
+  BTreeNode superblock;
+
+  if ((rc=superblock.Unserialize(&cache,0))!=ERROR_NOERROR) {
+    cerr << "Can't read superblock due to error "<<rc<<endl;
+    return -1;
+  }
+  if (superblock.info.keysize>32) {
+    cerr << "Keys of "<<superblock.info.keysize<<" bytes are too long\n";
+    return -1;
+  }
+
+  vector<StressThread> work(numthreads);
+  vector<thread> threads;
+
+  chrono::steady_clock::time_point start=chrono::steady_clock::now();
+
+  for (SIZE_T i=0; i<numthreads; i++) {
+    work[i].btree=&btree;
+    work[i].numlookups=numlookups;
+    work[i].maxkey=maxkey;
+    work[i].keysize=superblock.info.keysize;
+    work[i].seed=i+1;
+    threads.push_back(thread(ref(work[i])));
+  }
+  for (SIZE_T i=0; i<numthreads; i++) {
+    threads[i].join();
+  }
+
+  double elapsed=chrono::duration<double>(chrono::steady_clock::now()-start).count();
+  SIZE_T found=0, errors=0;
+
+  for (SIZE_T i=0; i<numthreads; i++) {
+    found+=work[i].found;
+    errors+=work[i].errors;
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  cerr << "Performance statistics:\n";
+
+  cerr << "numthreads      = "<<numthreads<<endl;
+  cerr << "numshards       = "<<cache.GetNumShards()<<endl;
+  cerr << "numlookups      = "<<numthreads*numlookups<<endl;
+  cerr << "numfound        = "<<found<<endl;
+  cerr << "numerrors       = "<<errors<<endl;
+  cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+  cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+  cerr << endl;
+
+  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+  cerr << "wall time (s)   = "<<elapsed<<endl;
+  cerr << "lookups/s       = "<<(elapsed>0 ? numthreads*numlookups/elapsed : 0)<<endl;
+
+  return errors>0 ? -1 : 0;
+}
@@ -1,92 +1,1016 @@
+#include <algorithm>
+#include <functional>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
 #include "buffercache.h"
 
-ERROR_T BufferCache::CheckDeleteOldest()
+#define CACHE_LINE_SIZE 64
+#define PAGE_SIZE_BYTES 4096
+#define HUGE_PAGE_SIZE  (2*1024*1024)
+#define NO_BLOCK        ((SIZE_T)-1)
+
+// Pins the calling thread holds, by shard.  A thread uses few shards
+// at once, so a short list beats a hash table here.
+static thread_local vector<pair<const CacheShard *, SIZE_T> > heldpins;
+
+static SIZE_T &HeldPins(const CacheShard &s)
+{
+  for (vector<pair<const CacheShard *, SIZE_T> >::iterator i=heldpins.begin(); i!=heldpins.end(); ++i) {
+    if ((*i).first==&s) {
+      return (*i).second;
+    }
+  }
+  heldpins.push_back(pair<const CacheShard *, SIZE_T>(&s,0));
+  return heldpins.back().second;
+}
+
+struct FrameBlockOrder {
+  bool operator()(const BufferFrame *a, const BufferFrame *b) const { return a->blocknum<b->blocknum; }
+};
+
+CacheShard &BufferCache::ShardOf(const SIZE_T blocknum) const
+{
+  return *shards[(blocknum/SHARD_STRIPE)%shards.size()];
+}
+
+// One allocation for all the frames, kept across Detach/Attach
+// Each shard gets its own contiguous slice
+ERROR_T BufferCache::AllocateArena()
+{
+  // frames line up with what direct I/O wants, if it wants more
+  size_t line=disk->GetIOAlignment()>CACHE_LINE_SIZE ? disk->GetIOAlignment() : CACHE_LINE_SIZE;
+  size_t stride=(GetBlockSize()+line-1)/line*line;
+  size_t align=hugepages ? HUGE_PAGE_SIZE : PAGE_SIZE_BYTES;
+
+  if (align<line) {
+    align=line;
+  }
+  size_t bytes=((size_t)cachesize*stride+align-1)/align*align;
+
+  if (!arena || framestride!=stride || arenabytes!=bytes) {
+    FreeArena();
+    void *p;
+    if (posix_memalign(&p,align,bytes)) {
+      return ERROR_NOMEM;
+    }
+#ifdef MADV_HUGEPAGE
+    if (hugepages) {
+      madvise(p,bytes,MADV_HUGEPAGE); // only advice, so failure is fine
+    }
+#endif
+    arena=(BYTE_T *)p;
+    arenabytes=bytes;
+    framestride=stride;
+  }
+
+  // handed out lowest address first
+  BYTE_T *slice=arena;
+  for (vector<CacheShard *>::const_iterator s=shards.begin(); s!=shards.end(); ++s) {
+    (*s)->freeframes.clear();
+    for (SIZE_T i=(*s)->capacity; i>0; i--) {
+      (*s)->freeframes.push_back(slice+(size_t)(i-1)*framestride);
+    }
+    slice+=(size_t)(*s)->capacity*framestride;
+  }
+  return ERROR_NOERROR;
+}
+
+void BufferCache::FreeArena()
+{
+  free(arena);
+  arena=0;
+  arenabytes=0;
+  for (vector<CacheShard *>::const_iterator s=shards.begin(); s!=shards.end(); ++s) {
+    (*s)->freeframes.clear();
+  }
+}
+
+// Returns 0 if no frame is free
+BufferFrame *BufferCache::NewFrame(CacheShard &s, const SIZE_T blocknum)
+{
+  if (s.freeframes.empty()) {
+    return 0;
+  }
+  BufferFrame *f=new BufferFrame(blocknum,s.freeframes.back());
+  s.freeframes.pop_back();
+  return f;
+}
+
+void BufferCache::DeleteFrame(CacheShard &s, BufferFrame *f)
+{
+  // the frame may go, but not while the disk is still using it
+  disk->Wait(f->io);
+  s.freeframes.push_back(f->data);
+  delete f;
+  FrameFreed(s);
+}
+
+void BufferCache::Touch(CacheShard &s, BufferFrame *f)
+{
+  f->lastaccessed=curtime;
+  s.policy->Touch(f->blocknum,f->lastaccessed);
+}
+
+// A new frame goes either to the policy or to the end of the ring
+void BufferCache::Adopt(CacheShard &s, BufferFrame *f, const AccessHint hint)
+{
+  f->lastaccessed=curtime;
+  s.blockmap[f->blocknum]=f;
+  if (hint==ACCESS_SEQUENTIAL_ONCE) {
+    f->inring=true;
+    s.ring.push_back(f->blocknum);
+  } else {
+    if (hint==ACCESS_KEEP_HOT) {
+      MakeHot(s,f,true);
+    }
+    s.policy->Insert(f->blocknum,f->lastaccessed);
+  }
+}
+
+// Throw a frame out of the cache without writing it
+void BufferCache::Drop(CacheShard &s, BufferFrame *f)
+{
+  if (f->inring) {
+    s.ring.remove(f->blocknum);
+  } else {
+    s.policy->Remove(f->blocknum);
+  }
+  if (f->hot) {
+    s.hotframes--;
+  }
+  s.blockmap.erase(f->blocknum);
+  DeleteFrame(s,f);
+}
+
+// Drop, but a clean frame the policy gave up leaves a compressed
+// copy behind.  A prefetch still in flight has nothing to keep yet.
+void BufferCache::Evict(CacheShard &s, BufferFrame *f)
+{
+  if (WaitIO(s,f)==ERROR_NOERROR && victims && !f->dirty && !f->inring && Arrived(f)) {
+    lock_guard<mutex> l(victimlatch);
+    victims->Put(f->blocknum,f->data);
+  }
+  Drop(s,f);
+}
+
+bool BufferCache::TakeVictim(const SIZE_T blocknum, BYTE_T *data)
+{
+  if (!victims) {
+    return false;
+  }
+
+  lock_guard<mutex> l(victimlatch);
+
+  if (!victims->Take(blocknum,data)) {
+    return false;
+  }
+  victimhits++;
+  return true;
+}
+
+void BufferCache::ForgetVictim(const SIZE_T blocknum, const SIZE_T num)
+{
+  if (victims) {
+    lock_guard<mutex> l(victimlatch);
+    victims->Forget(blocknum,num);
+  }
+}
+
+// Only up to the quota; past it a frame asked to be hot stays normal
+// rather than pushing out one that got there first
+void BufferCache::MakeHot(CacheShard &s, BufferFrame *f, const bool hot)
+{
+  if (hot==f->hot) {
+    return;
+  }
+  if (hot) {
+    if (s.hotframes>=hotquota*s.capacity) {
+      return;
+    }
+    s.hotframes++;
+  } else {
+    s.hotframes--;
+  }
+  f->hot=hot;
+}
+
+// Does bringing in a block with this hint mean giving one up?
+bool BufferCache::IsFull(const CacheShard &s, const AccessHint hint) const
+{
+  return s.blockmap.size()>=s.capacity
+    || (hint==ACCESS_SEQUENTIAL_ONCE && s.ring.size()>=s.ringsize);
+}
+
+// Unless inflight is set, a prefetch still on its way is passed
+// over, since the scan has yet to get to it
+BufferFrame *BufferCache::FindRingVictim(CacheShard &s, const bool inflight)
+{
+  for (list<SIZE_T>::const_iterator i=s.ring.begin(); i!=s.ring.end(); ++i) {
+    BufferFrame *f=s.blockmap[*i];
+    if (f->pincount==0 && (inflight || Arrived(f))) {
+      return f;
+    }
+  }
+  return 0;
+}
+
+// Ring frames go first, except that a scan whose ring has not
+// grown to size yet takes its frame from the policy.  Hot frames
+// are only offered to the policy if nothing else will do.
+// Returns 0 if every frame is pinned
+BufferFrame *BufferCache::FindVictim(CacheShard &s, const SIZE_T incoming, const AccessHint hint)
+{
+  BufferFrame *f;
+  SIZE_T victim;
+
+  if (hint!=ACCESS_SEQUENTIAL_ONCE || s.ring.size()>=s.ringsize) {
+    if ((f=FindRingVictim(s,false))) {
+      return f;
+    }
+  }
+
+  if (s.policy->ChooseVictim(incoming,*this,victim)) {
+    return Elevator(s,incoming,s.blockmap[victim]);
+  }
+  if (s.hotframes>0) {
+    s.evicthot=true;
+    bool found=s.policy->ChooseVictim(incoming,*this,victim);
+    s.evicthot=false;
+    if (found) {
+      return s.blockmap[victim];
+    }
+  }
+  return FindRingVictim(s,true);
+}
+
+// How far the head has to sweep from where it is to get to the
+// block, always moving up and jumping back to the start at the end
+SIZE_T BufferCache::SweepDistance(const SIZE_T head, const SIZE_T blocknum) const
+{
+  return blocknum>=head ? blocknum-head : blocknum+GetNumBlocks()-head;
+}
+
+SIZE_T BufferCache::GetHeadBlock() const
+{
+  lock_guard<mutex> l(disklatch);
+
+  return disk->GetHeadBlock();
+}
+
+// oldest is the policy's (dirty) choice
+// A single write is best aimed at whatever the head reaches first;
+// the window keeps that from starving blocks far from the head
+BufferFrame *BufferCache::Elevator(CacheShard &s, const SIZE_T incoming, BufferFrame *oldest)
+{
+  if (!oldest->dirty || elevatorwindow<=1) {
+    return oldest;
+  }
+
+  // the policy only shows us what it would choose next
+  vector<SIZE_T> candidates;
+  s.policy->Candidates(incoming,*this,elevatorwindow,candidates);
+
+  // the head stays put while we look
+  lock_guard<mutex> l(disklatch);
+
+  BufferFrame *best=oldest;
+  double bestcost=disk->EstimatePositioning(oldest->blocknum);
+  SIZE_T looked=1;
+
+  for (vector<SIZE_T>::const_iterator i=candidates.begin(); i!=candidates.end() && looked<elevatorwindow; ++i) {
+    if (*i==oldest->blocknum) {
+      continue;
+    }
+    looked++;
+    BufferFrame *f=s.blockmap[*i];
+    if (f->dirty) {
+      double cost=disk->EstimatePositioning(*i);
+      if (cost<bestcost) {
+	best=f;
+	bestcost=cost;
+      }
+    }
+  }
+  return best;
+}
+
+// Called by the policy with the shard's latch held
+bool BufferCache::CanEvict(const SIZE_T blocknum) const
+{
+  const CacheShard &s=ShardOf(blocknum);
+  unordered_map<SIZE_T, BufferFrame *>::const_iterator i=s.blockmap.find(blocknum);
+
+  return i!=s.blockmap.end() && (*i).second->pincount==0
+    && (!(*i).second->hot || s.evicthot);
+}
+
+// curtime only moves forward
+void BufferCache::AdvanceTime(const double t)
+{
+  double now=curtime;
+
+  while (now<t && !curtime.compare_exchange_weak(now,t)) {
+  }
+}
+
+//
+// A foreground request waits for the disk to serve it, along with
+// whatever background work the disk takes on first
+// Call with disklatch held
+//
+void BufferCache::WaitForDisk(const DiskTicket &t)
+{
+  AdvanceTime(disk->Complete(t));
+}
+
+// Call with the shard's latch held
+// Whether f's data is here yet, as far as simulated time goes
+bool BufferCache::Arrived(BufferFrame *f)
+{
+  if (!f->ticket) {
+    return true;
+  }
+
+  lock_guard<mutex> l(disklatch);
+
+  if (!disk->IsDone(f->ticket,curtime)) {
+    return false;
+  }
+  f->ticket.reset();
+  return true;
+}
+
+// Call with disklatch held
+void BufferCache::RetirePrefetches()
+{
+  disk->Advance(curtime);
+
+  list<DiskTicket>::iterator i=prefetchqueue.begin();
+
+  while (i!=prefetchqueue.end()) {
+    if ((*i)->done && (*i)->finish<=curtime) {
+      i=prefetchqueue.erase(i);
+    } else {
+      ++i;
+    }
+  }
+}
+
+// Reads f's block straight into it.  f->ticket says when it
+// arrives.  A background read is a prefetch, and fails with
+// ERROR_NOFETCH if prefetchdepth of them are already in flight
+ERROR_T BufferCache::DiskRead(BufferFrame *f, const bool background)
 {
-  // In a real buffer cache, we would use a priority queue to make this O(1)
+  lock_guard<mutex> l(disklatch);
+  int rc;
 
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator oldestptr=blockmap.end();
-  double oldest = curtime+1;
+  if (background) {
+    RetirePrefetches();
+    if (prefetchqueue.size()>=prefetchdepth) {
+      return ERROR_NOFETCH;
+    }
+  }
 
-  // Only delete if the cache is full
-  if (blockmap.size() < cachesize) {
+  if (background) {
+    rc=disk->QueueRead(f->blocknum,vector<BYTE_T *>(1,f->data),curtime,f->ticket,f->io,iodone);
+    if (rc==ERROR_NOERROR) {
+      prefetchqueue.push_back(f->ticket);
+    }
+  } else {
+    IOHandle io;
+    rc=disk->QueueRead(f->blocknum,vector<BYTE_T *>(1,f->data),curtime,f->ticket,io);
+    if (rc==ERROR_NOERROR) {
+      rc=disk->Wait(io);
+      WaitForDisk(f->ticket);
+      f->ticket.reset();
+    }
+  }
+  diskreads++;
+  return rc;
+}
+
+// Call with the shard's latch held, before using f's data
+// Once the disk is done with it, a write that failed makes the
+// frame dirty again, and a read that failed is returned, now and
+// every time after, since the data never arrived
+ERROR_T BufferCache::WaitIO(CacheShard &s, BufferFrame *f)
+{
+  if (!f->io) {
     return ERROR_NOERROR;
   }
 
-  // Find oldest
+  int rc=disk->Wait(f->io);
 
-  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
-	 i!=blockmap.end();
-	 ++i) {
-       if ((*i).second.lastaccessed<oldest) { 
-	 oldestptr=i;
-	 oldest=(*i).second.lastaccessed;
-       }
-  }
-  
-  // write and delete it if it exists
- 
-  if (oldestptr!=blockmap.end()) { 
-    if ((*oldestptr).second.dirty) {
-      double reqtime;
-      int rc=disk->Write((*oldestptr).first,
-			 (*oldestptr).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
-      if (rc!=ERROR_NOERROR) { 
-	return rc;
+  if (f->io->write) {
+    if (rc!=ERROR_NOERROR) {
+      MarkDirty(s,f);
+    }
+    f->io.reset();
+    return ERROR_NOERROR;
+  }
+  if (rc==ERROR_NOERROR) {
+    f->io.reset();
+  }
+  return rc;
+}
+
+// Call with the shard's latch held, after blocknum missed
+// Returns how many of the blocks after it to read ahead
+SIZE_T BufferCache::SequentialMiss(const CacheShard &s, const SIZE_T blocknum, const AccessHint hint)
+{
+  lock_guard<mutex> l(disklatch);
+  SIZE_T limit = hint==ACCESS_SEQUENTIAL_ONCE ? s.ringsize-1 : s.capacity/4;
+
+  if (blocknum!=ranext) {
+    rarun=0;
+    rawindow=0;
+  } else if (++rarun>=READAHEAD_TRIGGER && readaheadmax>0) {
+    rawindow = rawindow>0 ? 2*rawindow : READAHEAD_INITIAL;
+  }
+  if (rawindow>readaheadmax) {
+    rawindow=readaheadmax;
+  }
+  if (rawindow>limit) {
+    rawindow=limit;
+  }
+  ranext=blocknum+1;
+  return rawindow;
+}
+
+// Reads up to numblocks blocks from first on in the background, as
+// one disk request.  Frames are set aside one shard at a time, and
+// only go into their shards once the request is issued, so no two
+// shard latches are ever held at once.  This is only a hint, so it
+// quietly reads less, or nothing, when it has to.
+void BufferCache::ReadAhead(const SIZE_T first, const SIZE_T numblocks, const AccessHint hint)
+{
+  vector<BufferFrame *> frames;
+  vector<BYTE_T *> bufs;
+
+  // the disk charges a track to track seek inside a request at least
+  // what a new request would cost, so a window ends with its track
+  for (SIZE_T blocknum=first;
+       blocknum<first+numblocks && blocknum<GetNumBlocks() && disk->GetTrack(blocknum)==disk->GetTrack(first);
+       blocknum++) {
+    CacheShard &s=ShardOf(blocknum);
+    lock_guard<mutex> l(s.latch);
+
+    if (s.blockmap.find(blocknum)!=s.blockmap.end()) {
+      break;
+    }
+    if (victims) {
+      // cheaper to get from memory when it is wanted
+      lock_guard<mutex> vl(victimlatch);
+      if (victims->Contains(blocknum)) {
+	break;
+      }
+    }
+    if (hint!=ACCESS_SEQUENTIAL_ONCE) {
+      s.policy->Miss(blocknum);
+    }
+    // frames set aside already are not in the map, but not free either
+    if (IsFull(s,hint) || s.freeframes.empty()) {
+      BufferFrame *victim=FindVictim(s,blocknum,hint);
+      if (victim) {
+	// a write of it that failed makes it dirty again
+	WaitIO(s,victim);
+      }
+      if (!victim || victim->dirty || !Arrived(victim)) {
+	break;
+      }
+      Evict(s,victim);
+    }
+    BufferFrame *f=NewFrame(s,blocknum);
+    if (!f) {
+      break;
+    }
+    frames.push_back(f);
+    bufs.push_back(f->data);
+  }
+
+  if (frames.empty()) {
+    return;
+  }
+
+  int rc;
+  DiskTicket ticket;
+  IOHandle io;
+
+  {
+    lock_guard<mutex> l(disklatch);
+
+    rc=disk->QueueRead(first,bufs,curtime,ticket,io,iodone);
+    if (rc==ERROR_NOERROR) {
+      diskreads+=frames.size();
+      readaheads+=frames.size();
+      ranext=first+frames.size();
+    }
+  }
+
+  for (vector<BufferFrame *>::const_iterator i=frames.begin(); i!=frames.end(); ++i) {
+    CacheShard &s=ShardOf((*i)->blocknum);
+    lock_guard<mutex> l(s.latch);
+
+    // another thread may have brought the block in meanwhile
+    (*i)->io=io;
+    if (rc!=ERROR_NOERROR || s.blockmap.find((*i)->blocknum)!=s.blockmap.end()) {
+      DeleteFrame(s,*i);
+    } else {
+      (*i)->ticket=ticket;
+      Adopt(s,*i,hint);
+      FrameFreed(s);
+    }
+  }
+}
+
+void BufferCache::MarkDirty(CacheShard &s, BufferFrame *f)
+{
+  if (!f->dirty) {
+    f->dirty=true;
+    s.numdirty++;
+  }
+}
+
+// One disk request for a run of frames holding consecutive blocks
+// In the background the disk does it after whatever it is doing,
+// and the foreground only notices if it needs the disk
+ERROR_T BufferCache::WriteRun(CacheShard &s, const vector<BufferFrame *> &run, const bool background)
+{
+  vector<const BYTE_T *> bufs;
+  int rc;
+  DiskTicket ticket;
+  IOHandle io;
+
+  for (vector<BufferFrame *>::const_iterator i=run.begin(); i!=run.end(); ++i) {
+    bufs.push_back((*i)->data);
+  }
+
+  {
+    lock_guard<mutex> l(disklatch);
+
+    if (background) {
+      rc=disk->QueueWrite(run.front()->blocknum,bufs,curtime,ticket,io,iodone);
+    } else {
+      rc=disk->QueueWrite(run.front()->blocknum,bufs,curtime,ticket,io);
+      if (rc==ERROR_NOERROR) {
+	rc=disk->Wait(io);
+	io.reset();
+	WaitForDisk(ticket);
       }
     }
-    blockmap.erase(oldestptr);
+  }
+  diskwrites+=run.size();
+  writeruns++;
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  for (vector<BufferFrame *>::const_iterator i=run.begin(); i!=run.end(); ++i) {
+    (*i)->dirty=false;
+    (*i)->io=io;
+    s.numdirty--;
+  }
+  return ERROR_NOERROR;
+}
+
+// Writes f along with any unpinned dirty blocks next to it
+// Runs stop at the edge of the shard's stripe, since the blocks
+// beyond belong to another shard
+ERROR_T BufferCache::WriteBack(CacheShard &s, BufferFrame *f)
+{
+  // an earlier write may still be going out, or have failed
+  WaitIO(s,f);
+  if (!f->dirty) {
+    return ERROR_NOERROR;
+  }
+
+  unordered_map<SIZE_T, BufferFrame *>::const_iterator n;
+  SIZE_T first=f->blocknum;
+  SIZE_T last=f->blocknum;
+
+  while (first>0
+	 && (n=s.blockmap.find(first-1))!=s.blockmap.end()
+	 && (*n).second->dirty && (*n).second->pincount==0) {
+    first--;
+  }
+  while ((n=s.blockmap.find(last+1))!=s.blockmap.end()
+	 && (*n).second->dirty && (*n).second->pincount==0) {
+    last++;
+  }
+
+  vector<BufferFrame *> run;
+
+  for (SIZE_T b=first; b<=last; b++) {
+    run.push_back(s.blockmap[b]);
+  }
+  return WriteRun(s,run,false);
+}
+
+// Runs are built from the shard's unpinned dirty blocks, and the
+// ones whose most recently used block is oldest go first
+ERROR_T BufferCache::WriteBehind(CacheShard &s)
+{
+  vector<BufferFrame *> dirty;
+
+  for (unordered_map<SIZE_T, BufferFrame *>::const_iterator i=s.blockmap.begin();
+       i!=s.blockmap.end();
+       ++i) {
+    if ((*i).second->dirty && (*i).second->pincount==0) {
+      dirty.push_back((*i).second);
+    }
+  }
+  sort(dirty.begin(),dirty.end(),FrameBlockOrder());
+
+  vector<vector<BufferFrame *> > runs;
+  vector<pair<double, SIZE_T> > order;  // (newest access, run)
+
+  for (vector<BufferFrame *>::const_iterator i=dirty.begin(); i!=dirty.end(); ++i) {
+    if (runs.empty() || runs.back().back()->blocknum+1!=(*i)->blocknum) {
+      runs.push_back(vector<BufferFrame *>());
+      order.push_back(pair<double, SIZE_T>((*i)->lastaccessed,runs.size()-1));
+    }
+    runs.back().push_back(*i);
+    if ((*i)->lastaccessed>order.back().first) {
+      order.back().first=(*i)->lastaccessed;
+    }
+  }
+  sort(order.begin(),order.end());
+
+  // enough of the coldest runs to get down to half the bound,
+  // written in one sweep across the disk
+  vector<pair<SIZE_T, SIZE_T> > sweep;  // (sweep distance, run)
+  SIZE_T left=s.numdirty;
+  SIZE_T head=GetHeadBlock();
+
+  for (vector<pair<double, SIZE_T> >::const_iterator i=order.begin();
+       i!=order.end() && left>dirtyratio*s.capacity/2;
+       ++i) {
+    const vector<BufferFrame *> &run=runs[(*i).second];
+    sweep.push_back(pair<SIZE_T, SIZE_T>(SweepDistance(head,run.front()->blocknum),(*i).second));
+    left-=run.size();
+  }
+  sort(sweep.begin(),sweep.end());
+
+  for (vector<pair<SIZE_T, SIZE_T> >::const_iterator i=sweep.begin(); i!=sweep.end(); ++i) {
+    int rc=WriteRun(s,runs[(*i).second],true);
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
   }
   return ERROR_NOERROR;
 }
 
+ERROR_T BufferCache::CheckDeleteOldest(CacheShard &s, const SIZE_T incoming, const AccessHint hint)
+{
+  // Only delete if the shard (or its scan ring) is full
+  if (!IsFull(s,hint)) {
+    return ERROR_NOERROR;
+  }
+
+  // Pick a victim, then write and delete it
+
+  BufferFrame *f=FindVictim(s,incoming,hint);
+
+  if (!f) {
+    // everything is pinned
+    return ERROR_NOMEM;
+  }
+
+  int rc=WriteBack(s,f);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  Evict(s,f);
+  return ERROR_NOERROR;
+}
+
+// A miss has nowhere to go when every frame is pinned, or, with room
+// in the shard, when the free frames are all set aside for read-ahead
+bool BufferCache::NoFrame(const CacheShard &s, const AccessHint hint) const
+{
+  return IsFull(s,hint) ? s.pinnedframes>=s.blockmap.size() : s.freeframes.empty();
+}
+
+// Call with the shard's latch held in l.  Returns false, without
+// waiting, if no other thread can give a frame back: every pin on the
+// shard is held by a thread waiting here, this one included, and no
+// frames are set aside
+bool BufferCache::WaitForFrame(CacheShard &s, unique_lock<mutex> &l)
+{
+  SIZE_T mine=HeldPins(s);
+  SIZE_T setaside=s.capacity-s.blockmap.size()-s.freeframes.size();
+
+  if (setaside==0 && s.waitingpins+mine>=s.pins) {
+    return false;
+  }
+  s.waiters++;
+  s.waitingpins+=mine;
+  s.framefreed.wait(l);
+  s.waitingpins-=mine;
+  s.waiters--;
+  return true;
+}
+
+// Call with the shard's latch held, when a frame was unpinned, freed
+// or taken over from a read-ahead
+void BufferCache::FrameFreed(CacheShard &s)
+{
+  if (s.waiters>0) {
+    s.framefreed.notify_all();
+  }
+}
+
 BufferCache::BufferCache(DiskSystem *d,
-			 SIZE_T cs) : 
-   disk(d), cachesize(cs), curtime(0),
-   allocs(0), deallocs(0), reads(0), writes(0),
-   diskreads(0), diskwrites(0)
-{}
+			 SIZE_T cs,
+			 const string &p,
+			 const SIZE_T ns) :
+   disk(d), cachesize(cs), arena(0), arenabytes(0), framestride(0), hugepages(false),
+   warmmanifest(false), hotquota(0.25),
+   dirtyratio(1.0), elevatorwindow(1), prefetchdepth(1), readaheadmax(0),
+   ranext(NO_BLOCK), rarun(0), rawindow(0), mrc(0),
+   victimframes(0), victims(0),
+   curtime(0), allocs(0), deallocs(0), reads(0), writes(0),
+   diskreads(0), diskwrites(0), prefetches(0), readaheads(0), victimhits(0), writeruns(0), warmblocks(0),
+   asyncios(0), asyncfailures(0)
+{
+  iodone=[this](const IORequest &r) {
+    asyncios++;
+    if (r.result!=ERROR_NOERROR) {
+      asyncfailures++;
+    }
+  };
+
+  SIZE_T numshards = ns<1 ? 1 : ns>cs && cs>0 ? cs : ns;
+
+  // the first cachesize%numshards shards get one frame more
+  for (SIZE_T i=0; i<numshards; i++) {
+    SIZE_T cap=cs/numshards+(i<cs%numshards ? 1 : 0);
+    CachePolicy *policy=CachePolicy::Create(p,cap);
+    if (!policy) {
+      cerr << "BufferCache: unknown replacement policy "<<p<<endl;
+      for (vector<CacheShard *>::const_iterator s=shards.begin(); s!=shards.end(); ++s) {
+	delete *s;
+      }
+      throw GenericException();
+    }
+    shards.push_back(new CacheShard(cap,policy));
+  }
+}
 
 
 BufferCache::~BufferCache()
 {
-  if (disk) { 
+  if (disk) {
     Detach();
   }
+  FreeArena();
+  for (vector<CacheShard *>::const_iterator s=shards.begin(); s!=shards.end(); ++s) {
+    delete *s;
+  }
+  shards.clear();
+  delete mrc;
+  mrc=0;
+  delete victims;
+  victims=0;
   disk=0; cachesize=0; curtime=0;
 }
 
-ERROR_T BufferCache::Attach()
+// Empty the cache without writing anything
+ERROR_T BufferCache::Reset()
 {
-  blockmap.clear();
+  // nothing may land in a frame once it is gone
+  disk->Drain();
+  for (vector<CacheShard *>::const_iterator s=shards.begin(); s!=shards.end(); ++s) {
+    for (unordered_map<SIZE_T, BufferFrame *>::iterator i=(*s)->blockmap.begin();
+	 i!=(*s)->blockmap.end();
+	 ++i) {
+      delete (*i).second;
+    }
+    (*s)->blockmap.clear();
+    (*s)->policy->Clear();
+    (*s)->ring.clear();
+    (*s)->hotframes=0;
+    (*s)->numdirty=0;
+  }
+  int rc=AllocateArena();
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  prefetchqueue.clear();
+  ranext=NO_BLOCK;
+  rarun=0;
+  rawindow=0;
+  if (victims) {
+    victims->Clear();
+  } else if (victimframes>0) {
+    victims=new CompressedVictimCache(victimframes*GetBlockSize(),GetBlockSize());
+  }
+  if (mrc) {
+    mrc->Clear();
+  }
   return ERROR_NOERROR;
 }
 
-ERROR_T BufferCache::Detach()
+ERROR_T BufferCache::Attach()
 {
-  // write out all of our data and then throw it away
+  int rc=Reset();
+
+  if (rc!=ERROR_NOERROR || !warmmanifest) {
+    return rc;
+  }
+  return WarmUp();
+}
+
+string BufferCache::GetManifestName() const
+{
+  return disk->GetFileStem()+".warm";
+}
 
-  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
-	 i!=blockmap.end();
+struct ManifestOrder {
+  // hot frames first, then most recently used
+  bool operator()(const BufferFrame *a, const BufferFrame *b) const {
+    if (a->hot!=b->hot) {
+      return a->hot;
+    }
+    if (a->lastaccessed!=b->lastaccessed) {
+      return a->lastaccessed>b->lastaccessed;
+    }
+    return a->blocknum<b->blocknum;
+  }
+};
+
+// One block number per line, hottest first.  Frames in the scan
+// ring were only passing through, so they are left out.
+ERROR_T BufferCache::WriteManifest()
+{
+  vector<BufferFrame *> frames;
+
+  for (vector<CacheShard *>::const_iterator s=shards.begin(); s!=shards.end(); ++s) {
+    for (unordered_map<SIZE_T, BufferFrame *>::const_iterator i=(*s)->blockmap.begin();
+	 i!=(*s)->blockmap.end();
 	 ++i) {
-    if ((*i).second.dirty) { 
-      double reqtime;
-      int rc=disk->Write((*i).first,
-			 (*i).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
-      if (rc!=ERROR_NOERROR) { 
-	return rc;
+      if (!(*i).second->inring) {
+	frames.push_back((*i).second);
       }
     }
   }
-  blockmap.clear();
+  if (frames.empty()) {
+    // eg, a second Detach; keep what the first one wrote
+    return ERROR_NOERROR;
+  }
+  sort(frames.begin(),frames.end(),ManifestOrder());
+
+  FILE *f=fopen(GetManifestName().c_str(),"w");
+
+  if (!f) {
+    return ERROR_NOFILE;
+  }
+  fprintf(f,"# buffercache warm-up manifest, hottest block first\n");
+  for (vector<BufferFrame *>::const_iterator i=frames.begin(); i!=frames.end(); ++i) {
+    fprintf(f,"%" PRI_SIZE_T "\n",(*i)->blocknum);
+  }
+  fclose(f);
   return ERROR_NOERROR;
 }
 
+//
+// As many of the manifest's blocks as fit, hottest first, are read
+// in block order, one request per run of adjacent blocks.  Block
+// order is (track, sector) order, so that is a single sweep.
+// A missing manifest just means a cold start.
+//
+ERROR_T BufferCache::WarmUp()
+{
+  FILE *f=fopen(GetManifestName().c_str(),"r");
+
+  if (!f) {
+    return ERROR_NOERROR;
+  }
+
+  vector<BufferFrame *> frames;
+  char line[80];
+  SIZE_T blocknum;
+
+  while (fgets(line,80,f)) {
+    if (line[0]=='#' || sscanf(line,"%" SCN_SIZE_T,&blocknum)!=1 || blocknum>=GetNumBlocks()) {
+      continue;
+    }
+    CacheShard &s=ShardOf(blocknum);
+    if (s.blockmap.find(blocknum)!=s.blockmap.end()) {
+      continue;
+    }
+    BufferFrame *frame=NewFrame(s,blocknum);
+    if (frame) {
+      // in the map now so that duplicates are skipped, adopted below
+      s.blockmap[blocknum]=frame;
+      frames.push_back(frame);
+    }
+  }
+  fclose(f);
+
+  // adopted coldest first, so the policy sees the hottest as most recent
+  vector<BufferFrame *> hotness(frames.rbegin(),frames.rend());
+
+  sort(frames.begin(),frames.end(),FrameBlockOrder());
+
+  int rc=ERROR_NOERROR;
+  vector<BufferFrame *>::const_iterator i=frames.begin();
+
+  while (i!=frames.end() && rc==ERROR_NOERROR) {
+    vector<BYTE_T *> bufs;
+    SIZE_T first=(*i)->blocknum;
+    DiskTicket ticket;
+    IOHandle io;
+
+    do {
+      bufs.push_back((*i)->data);
+      ++i;
+    } while (i!=frames.end() && (*i)->blocknum==first+bufs.size());
+
+    lock_guard<mutex> l(disklatch);
+    rc=disk->QueueRead(first,bufs,curtime,ticket,io);
+    if (rc==ERROR_NOERROR) {
+      rc=disk->Wait(io);
+      WaitForDisk(ticket);
+    }
+    diskreads+=bufs.size();
+    warmblocks+=bufs.size();
+  }
+
+  for (vector<BufferFrame *>::const_iterator h=hotness.begin(); h!=hotness.end(); ++h) {
+    CacheShard &s=ShardOf((*h)->blocknum);
+    if (rc==ERROR_NOERROR) {
+      Adopt(s,*h,ACCESS_NORMAL);
+    } else {
+      s.blockmap.erase((*h)->blocknum);
+      DeleteFrame(s,*h);
+    }
+  }
+  return rc;
+}
+
+ERROR_T BufferCache::Sync()
+{
+  // dirty blocks go out in one C-LOOK sweep from the head, so the
+  // disk sees the same sweep whatever the hash order is
+  // WriteBack takes the rest of each run along with the block
+
+  vector<pair<SIZE_T, SIZE_T> > dirtyblocks;  // (sweep distance, block)
+  SIZE_T head=GetHeadBlock();
+
+  // background writes that failed have to go again
+  disk->Drain();
+  for (vector<CacheShard *>::const_iterator s=shards.begin(); s!=shards.end(); ++s) {
+    lock_guard<mutex> l((*s)->latch);
+    for (unordered_map<SIZE_T, BufferFrame *>::iterator i=(*s)->blockmap.begin();
+	 i!=(*s)->blockmap.end();
+	 ++i) {
+      WaitIO(**s,(*i).second);
+      if ((*i).second->dirty) {
+	dirtyblocks.push_back(pair<SIZE_T, SIZE_T>(SweepDistance(head,(*i).first),(*i).first));
+      }
+    }
+  }
+  sort(dirtyblocks.begin(),dirtyblocks.end());
+
+  for (vector<pair<SIZE_T, SIZE_T> >::const_iterator i=dirtyblocks.begin();
+       i!=dirtyblocks.end();
+       ++i) {
+    CacheShard &s=ShardOf((*i).second);
+    lock_guard<mutex> l(s.latch);
+    unordered_map<SIZE_T, BufferFrame *>::iterator b=s.blockmap.find((*i).second);
+    // it may have gone out since, eg, in a neighbor's run
+    if (b==s.blockmap.end()) {
+      continue;
+    }
+    int rc=WriteBack(s,(*b).second);
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+  }
+
+  lock_guard<mutex> l(disklatch);
+  // and let any prefetches still in flight finish
+  AdvanceTime(disk->CompleteAll());
+  return disk->Sync(0,GetNumBlocks());
+}
+
+ERROR_T BufferCache::Detach()
+{
+  // write out all of our data and then throw it away
+  int rc=Sync();
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  rc=warmmanifest ? WriteManifest() : ERROR_NOERROR;
+  int rrc=Reset();
+
+  return rc!=ERROR_NOERROR ? rc : rrc;
+}
+
 
 SIZE_T BufferCache::GetCacheSize() const
 {
@@ -109,139 +1033,449 @@ double BufferCache::GetCurrentTime() const
   return curtime;
 }
 
-ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
+size_t BufferCache::GetMemoryUsage() const
+{
+  size_t frames=0;
+
+  for (vector<CacheShard *>::const_iterator s=shards.begin(); s!=shards.end(); ++s) {
+    lock_guard<mutex> l((*s)->latch);
+    frames+=(*s)->blockmap.size();
+  }
+  size_t victimbytes=0;
+
+  if (victims) {
+    lock_guard<mutex> l(victimlatch);
+    victimbytes=victims->GetUsed();
+  }
+  return arenabytes+frames*sizeof(BufferFrame)+victimbytes;
+}
+
+const char *BufferCache::GetPolicyName() const
+{
+  return shards.front()->policy->GetName();
+}
+
+void BufferCache::SetRingSize(const SIZE_T size)
+{
+  for (vector<CacheShard *>::const_iterator s=shards.begin(); s!=shards.end(); ++s) {
+    (*s)->ringsize = size>0 ? size : 1;
+  }
+}
+
+void BufferCache::SetVictimCache(const SIZE_T frames)
+{
+  delete victims;
+  victims=0;
+  victimframes=frames;
+}
+
+void BufferCache::TrackMissRatio(const SIZE_T maxdepth)
 {
-  allocs++;
-  return disk->NotifyAllocateBlocks(outblocknum,1);
+  delete mrc;
+  mrc = maxdepth>0 ? new StackDistanceTracker(maxdepth) : 0;
+}
+
+double BufferCache::GetEstimatedMissRatio(const SIZE_T size) const
+{
+  lock_guard<mutex> l(mrclatch);
+
+  if (!mrc || size>mrc->GetMaxDepth()) {
+    return -1;
+  }
+  return mrc->GetMissRatio(size);
+}
+
+ostream & BufferCache::PrintMissRatioCurve(ostream &os) const
+{
+  lock_guard<mutex> l(mrclatch);
+
+  if (mrc) {
+    mrc->Print(os,cachesize);
+  }
+  return os;
+}
+
+ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum, const SIZE_T num)
+{
+  lock_guard<mutex> l(disklatch);
+
+  allocs+=num;
+  return disk->NotifyAllocateBlocks(outblocknum,num);
 }
 
-ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
+ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum, const SIZE_T num)
 {
-  deallocs++;
-  return disk->NotifyDeallocateBlocks(inblocknum,1);
+  // victimlatch is never taken with disklatch held
+  ForgetVictim(inblocknum,num);
+
+  lock_guard<mutex> l(disklatch);
+
+  deallocs+=num;
+  return disk->NotifyDeallocateBlocks(inblocknum,num);
 }
 
 
 bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 {
+  lock_guard<mutex> l(disklatch);
+
   return disk->IsBlockAllocated(inblocknum);
 }
 
+ERROR_T BufferCache::FindFreeBlocks(const SIZE_T num, SIZE_T &block, const SIZE_T from)
+{
+  lock_guard<mutex> l(disklatch);
+
+  return disk->FindFreeBlocks(num,block,from);
+}
+
 
-ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
+ERROR_T BufferCache::PinBlock(const SIZE_T blocknum, BYTE_T *&data, const bool fill,
+			      const AccessHint hint)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+  CacheShard &s=ShardOf(blocknum);
+  unique_lock<mutex> l(s.latch);
+  unordered_map<SIZE_T, BufferFrame *>::iterator b;
+  BufferFrame *f;
+  SIZE_T window=0;
+
+  if (mrc) {
+    lock_guard<mutex> ml(mrclatch);
+    mrc->Reference(blocknum,fill);
+  }
+
+  b = s.blockmap.find(blocknum);
 
-  b = blockmap.find(inblocknum);
+  // with every frame pinned by other threads, a miss waits for one
+  while (b==s.blockmap.end() && NoFrame(s,hint)) {
+    if (!WaitForFrame(s,l)) {
+      return ERROR_NOMEM;
+    }
+    b = s.blockmap.find(blocknum);
+  }
 
-  if (b!=blockmap.end()) {
-    // It's in  cache, just update its lastaccessed and return it
-    outblock=(*b).second;
-    (*b).second.lastaccessed=curtime;
-    reads++;
-	return ERROR_NOERROR;
-  } 
-  
-  else {
+  if (b!=s.blockmap.end()) {
+    // It's in  cache, just update its lastaccessed
+    f=(*b).second;
+    int rc=WaitIO(s,f);
+    if (rc!=ERROR_NOERROR) {
+      if (fill) {
+	// the read in the background never got it
+	if (f->pincount==0) {
+	  Drop(s,f);
+	}
+	return rc;
+      }
+      // the caller fills it in anyway
+      f->io.reset();
+    }
+    if (fill) {
+      // if it was prefetched and hasn't arrived yet, wait for it
+      if (f->ticket) {
+	lock_guard<mutex> dl(disklatch);
+	WaitForDisk(f->ticket);
+      }
+      reads++;
+    }
+    // without fill, any prefetch in flight is moot since it will be overwritten
+    f->ticket.reset();
+    if (hint==ACCESS_SEQUENTIAL_ONCE) {
+      // a scan passing through leaves the frame where it was
+    } else if (f->inring) {
+      // wanted after all, so the policy takes it over
+      s.ring.remove(blocknum);
+      f->inring=false;
+      Adopt(s,f,hint);
+    } else {
+      if (hint==ACCESS_KEEP_HOT) {
+	MakeHot(s,f,true);
+      }
+      Touch(s,f);
+    }
+  } else {
     // It's not in cache, so time to allocate it
-    CheckDeleteOldest();
-    // read it from disk
-    if (!(disk->IsBlockAllocated(inblocknum))) { //then put it into buffer
+    if (hint!=ACCESS_SEQUENTIAL_ONCE) {
+      s.policy->Miss(blocknum);
+    }
+    int rc=CheckDeleteOldest(s,blocknum,hint); //kick out whatever the policy picks
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+    if (!IsBlockAllocated(blocknum)) {
       if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
-	cerr << "BufferCache::ReadBlock: Attempt to read unallocated block " << inblocknum<<endl;
+	cerr << "BufferCache::PinBlock: Attempt to access unallocated block " << blocknum<<endl;
       }
     }
-    double reqtime;
-    int rc = disk->Read(inblocknum,
-			outblock,
-			reqtime);
-    curtime+=reqtime;
-    diskreads++;
-    if (rc!=ERROR_NOERROR) { 
-      return rc;
-    } else {
-      outblock.lastaccessed=curtime;
-      outblock.dirty=false;
-      blockmap[inblocknum]=outblock;
+    if (!(f=NewFrame(s,blocknum))) {
+      return ERROR_NOMEM;
+    }
+    if (fill && TakeVictim(blocknum,f->data)) {
+      // still in memory, just compressed
       reads++;
-      return ERROR_NOERROR;
+    } else if (fill) {
+      // read it from disk, right into the frame
+      rc=DiskRead(f,false);
+      if (rc!=ERROR_NOERROR) {
+	DeleteFrame(s,f);
+	return rc;
+      }
+      reads++;
+      window=SequentialMiss(s,blocknum,hint);
+    } else {
+      // the caller will fill it in, so any old copy is stale
+      ForgetVictim(blocknum);
+    }
+    Adopt(s,f,hint);
+  }
+
+  if (f->pincount++==0) {
+    s.pinnedframes++;
+  }
+  s.pins++;
+  HeldPins(s)++;
+  data=f->data;
+
+  if (window>0) {
+    // the frame is pinned, so it is safe to let go of the shard
+    l.unlock();
+    ReadAhead(blocknum+1,window,hint);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::SetKeepHot(const SIZE_T blocknum, const bool hot)
+{
+  CacheShard &s=ShardOf(blocknum);
+  lock_guard<mutex> l(s.latch);
+  unordered_map<SIZE_T, BufferFrame *>::iterator b;
+
+  b = s.blockmap.find(blocknum);
+
+  if (b==s.blockmap.end()) {
+    return ERROR_NONEXISTENT;
+  }
+  if (!(*b).second->inring) {
+    MakeHot(s,(*b).second,hot);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::UnpinBlock(const SIZE_T blocknum, const bool dirty)
+{
+  CacheShard &s=ShardOf(blocknum);
+  lock_guard<mutex> l(s.latch);
+  unordered_map<SIZE_T, BufferFrame *>::iterator b;
+
+  b = s.blockmap.find(blocknum);
+
+  if (b==s.blockmap.end() || (*b).second->pincount==0) {
+    return ERROR_NONEXISTENT;
+  }
+
+  BufferFrame *f=(*b).second;
+
+  s.pins--;
+  // it may have been pinned by another thread
+  SIZE_T &mine=HeldPins(s);
+  if (mine>0) {
+    mine--;
+  }
+  if (--f->pincount==0) {
+    s.pinnedframes--;
+    FrameFreed(s);
+  }
+  if (dirty) {
+    MarkDirty(s,f);
+    writes++;
+    if (s.numdirty>dirtyratio*s.capacity) {
+      return WriteBehind(s);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock,
+			       const AccessHint hint)
+{
+  BYTE_T *data;
+
+  int rc=PinBlock(inblocknum,data,true,hint);
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  if (outblock.length!=GetBlockSize()) {
+    rc=outblock.Resize(GetBlockSize(),false);
+    if (rc!=ERROR_NOERROR) {
+      UnpinBlock(inblocknum);
+      return rc;
     }
   }
-} 
- 
+  // the frame stays put while pinned, so the copy needs no latch
+  memcpy(outblock.data,data,GetBlockSize());
+  {
+    CacheShard &s=ShardOf(inblocknum);
+    lock_guard<mutex> l(s.latch);
+    const BufferFrame *f=s.blockmap[inblocknum];
+    outblock.lastaccessed=f->lastaccessed;
+    outblock.dirty=f->dirty;
+  }
+
+  return UnpinBlock(inblocknum);
+}
+
 
 
 //called from serialize. inblocknum is the block location that you are calling
 ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
-  
-  b = blockmap.find(inblocknum);
-  //map<SIZE_T, Block, cache_compare_lessthan> blockmap; // blockmap is declared as a member of buffer, its like a map i think
+  BYTE_T *data;
 
-  if (b!=blockmap.end()) {
-    // It's in  cache, so just replace the block
-    (*b).second=inblock; //the block altogether is replaced with the parameter, or block coming in
-    (*b).second.lastaccessed=curtime;
-    (*b).second.dirty=true;
-    writes++;
+  if (inblock.length!=GetBlockSize()) {
+    return ERROR_WRONGSIZEBLOCK;
+  }
+
+  int rc=PinBlock(inblocknum,data,false);
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  // copied into the frame's own buffer, which stays where it is
+  memcpy(data,inblock.data,inblock.length);
+
+  return UnpinBlock(inblocknum,true);
+}
+
+//
+// The block is read now but only arrives once the disk gets
+// through everything queued ahead of it.  A frame is free if the
+// shard is not full or if the oldest block is clean and already
+// here, since then it can be dropped without a disk write.
+// A sequential prefetch lands in the scan ring.
+//
+ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum,
+				    const AccessHint hint)
+{
+  if (blocknum>=GetNumBlocks()) {
+    return ERROR_NOSUCHBLOCK;
+  }
+
+  CacheShard &s=ShardOf(blocknum);
+  lock_guard<mutex> l(s.latch);
+
+  if (s.blockmap.find(blocknum)!=s.blockmap.end()) {
+    // already here or on its way
     return ERROR_NOERROR;
-  } 
-  
-  else {
-    // It's not in cache, so time to allocate it
-    CheckDeleteOldest(); //kick out least recently used
-    if (!(disk->IsBlockAllocated(inblocknum))) { //must save changes to memory before kicking it out if not already dirty
-      if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
-	cerr << "BufferCache::WriteBlock: Attempt to write unallocated block " << inblocknum << endl;
-      }
+  }
+
+  {
+    lock_guard<mutex> dl(disklatch);
+    RetirePrefetches();
+    if (prefetchqueue.size()>=prefetchdepth) {
+      return ERROR_NOFETCH;
     }
+  }
 
-    Block myblock=inblock;
-    myblock.lastaccessed=curtime;
-    myblock.dirty=true;
-    blockmap[inblocknum]=myblock; //find the index where your number is and put it ther
-    writes++;
+  if (hint!=ACCESS_SEQUENTIAL_ONCE) {
+    s.policy->Miss(blocknum);
+  }
+
+  if (IsFull(s,hint)) {
+    BufferFrame *victim=FindVictim(s,blocknum,hint);
+    if (victim) {
+      WaitIO(s,victim);
+    }
+    if (!victim || victim->dirty || !Arrived(victim)) {
+      return ERROR_NOFETCH;
+    }
+    Evict(s,victim);
+  }
+
+  BufferFrame *f=NewFrame(s,blocknum);
+  if (!f) {
+    return ERROR_NOFETCH;
+  }
+  if (TakeVictim(blocknum,f->data)) {
+    Adopt(s,f,hint);
     return ERROR_NOERROR;
   }
+  // another thread may have filled the queue since we looked,
+  // in which case DiskRead says so
+  int rc=DiskRead(f,true);
+  if (rc!=ERROR_NOERROR) {
+    DeleteFrame(s,f);
+    return rc;
+  }
+
+  prefetches++;
+  Adopt(s,f,hint);
+
+  return ERROR_NOERROR;
 }
-  
-ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
-{
-  // Not implemented yet
-  return ERROR_IMPLBUG;
-}
-  
+
 ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
-  
-  b = blockmap.find(blocknum);
+  CacheShard &s=ShardOf(blocknum);
+  lock_guard<mutex> l(s.latch);
+  unordered_map<SIZE_T, BufferFrame *>::iterator b;
 
-  if (b==blockmap.end()) { 
-    return ERROR_NOERROR;
+  b = s.blockmap.find(blocknum);
+
+  if (b==s.blockmap.end()) {
+    // it may have gone out earlier, eg when it was evicted
+    lock_guard<mutex> dl(disklatch);
+    return disk->Sync(blocknum,1);
   } else {
-    if ((*b).second.dirty) { 
-      double reqtime;
-      int rc;
-      rc=disk->Write((*b).first,
-		     (*b).second,
-		     reqtime);
-      diskwrites++;
-      curtime+=reqtime;
-      if (rc!=ERROR_NOERROR) { 
+    BufferFrame *f=(*b).second;
+    int rc=WriteBack(s,f);
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+    {
+      lock_guard<mutex> dl(disklatch);
+      if ((rc=disk->Sync(blocknum,1))!=ERROR_NOERROR) {
 	return rc;
       }
     }
-    blockmap.erase(b);
+    if (f->pincount>0) {
+      // written, but it has to stay where its users can see it
+      return ERROR_NOERROR;
+    }
+    Drop(s,f);
     return ERROR_NOERROR;
   }
 }
-  
+
 ostream & BufferCache::Print(ostream &os) const
 {
+  SIZE_T ringfill=0, ringsize=0, numdirty=0;
+  vector<pair<SIZE_T, bool> > blocks;  // (block, dirty)
+
   os << "BufferCache(cachesize="<<cachesize
+     << ", shards="<<shards.size()
+     << ", policy=";
+  for (vector<CacheShard *>::const_iterator s=shards.begin(); s!=shards.end(); ++s) {
+    lock_guard<mutex> l((*s)->latch);
+    if (s!=shards.begin()) {
+      os << "; ";
+    }
+    os << *(*s)->policy;
+    ringfill+=(*s)->ring.size();
+    ringsize+=(*s)->ringsize;
+    numdirty+=(*s)->numdirty;
+    for (unordered_map<SIZE_T, BufferFrame *>::const_iterator b=(*s)->blockmap.begin();
+	 b!=(*s)->blockmap.end();
+	 ++b) {
+      blocks.push_back(pair<SIZE_T, bool>((*b).first,(*b).second->dirty));
+    }
+  }
+  os << ", ring="<<ringfill<<"/"<<ringsize
      << ", blocksize="<<GetBlockSize()
+     << ", memory="<<GetMemoryUsage()<<" bytes"
+     << (hugepages ? " (huge pages)" : "")
      << ", curtime="<<curtime
      << ", allocs="<<allocs
      << ", deallocs="<<deallocs
@@ -249,19 +1483,35 @@ ostream & BufferCache::Print(ostream &os) const
      << ", writes="<<writes
      << ", diskreads="<<diskreads
      << ", diskwrites="<<diskwrites
-     << ", blocks = {";
+     << ", writeruns="<<writeruns
+     << ", dirty="<<numdirty
+     << ", prefetches="<<prefetches
+     << ", readaheads="<<readaheads
+     << ", victimhits="<<victimhits
+     << ", asyncios="<<asyncios
+     << ", asyncfailures="<<asyncfailures;
+  if (victims) {
+    lock_guard<mutex> l(victimlatch);
+    os << ", victims="<<*victims;
+  }
+  if (mrc) {
+    os << ", missratio=";
+    PrintMissRatioCurve(os);
+  }
+  os << ", blocks = {";
+
+  // listed in block order, as before
+  sort(blocks.begin(),blocks.end());
 
-  
-  for (map<SIZE_T, Block, cache_compare_lessthan>::const_iterator b=blockmap.begin(); 
-       b!=blockmap.end(); 
+  for (vector<pair<SIZE_T, bool> >::const_iterator b=blocks.begin();
+       b!=blocks.end();
        ++b) {
-    if (b!=blockmap.begin()) { 
+    if (b!=blocks.begin()) {
       os << ", ";
     }
-    os << (*b).first << ((*b).second.dirty ? "(dirty)" : "");
+    os << (*b).first << ((*b).second ? "(dirty)" : "");
   }
   os << "}, disk="<<*disk<<")";
-  
+
   return os;
 }
-  
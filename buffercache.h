@@ -2,18 +2,77 @@
 #define _buffercache
 
 #include <iostream>
-#include <map>
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include "global.h"
 #include "block.h"
 #include "disksystem.h"
+#include "cachepolicy.h"
+#include "missratio.h"
+#include "victimcache.h"
 
 using namespace std;
 
-struct cache_compare_lessthan {
-  bool operator()(const SIZE_T s1, const SIZE_T s2) const {
-    return s1<s2;
-  }
+//
+// How the caller expects to use a block it reads
+//
+// NORMAL          left to the replacement policy
+// SEQUENTIAL_ONCE part of a scan that will not come back to it soon,
+//                 so it goes through a small private ring of frames
+//                 instead of displacing the working set
+// KEEP_HOT        evicted only when nothing else can be, as long as
+//                 the shard's hot quota is not used up
+//
+enum AccessHint { ACCESS_NORMAL, ACCESS_SEQUENTIAL_ONCE, ACCESS_KEEP_HOT };
+
+struct BufferFrame {
+  SIZE_T         blocknum;
+  BYTE_T        *data;      // GetBlockSize() bytes in the cache's arena
+  double         lastaccessed;
+  bool           dirty;
+  DiskTicket     ticket;    // the read that brings the data, until it has arrived
+  SIZE_T         pincount;  // pinned frames are never evicted
+  bool           inring;    // in the scan ring, not known to the policy
+  bool           hot;
+  IOHandle       io;        // real I/O on data that may still be in flight
+
+  BufferFrame(const SIZE_T num, BYTE_T *d) : blocknum(num), data(d), lastaccessed(-1), dirty(false),
+    pincount(0), inring(false), hot(false) {}
+};
+
+
+//
+// One slice of the cache.  Every block belongs to exactly one shard
+// (see BufferCache::ShardOf), and everything in here is protected
+// by the shard's latch.
+//
+struct CacheShard {
+  mutex          latch;
+  SIZE_T         capacity;      // frames
+  unordered_map<SIZE_T, BufferFrame *> blockmap;
+  vector<BYTE_T *> freeframes;
+  CachePolicy   *policy;
+  list<SIZE_T>   ring;          // oldest first
+  SIZE_T         ringsize;
+  SIZE_T         hotframes;
+  SIZE_T         numdirty;
+  bool           evicthot;      // hot frames may be chosen right now
+  SIZE_T         pins;          // on all its frames together
+  SIZE_T         pinnedframes;
+  SIZE_T         waiters;       // misses waiting for a frame
+  SIZE_T         waitingpins;   // held by the waiting threads
+  condition_variable framefreed;
+
+  CacheShard(const SIZE_T cap, CachePolicy *p) : capacity(cap), policy(p),
+    ringsize(cap/4>8 ? 8 : cap/4<1 ? 1 : cap/4), hotframes(0), numdirty(0), evicthot(false),
+    pins(0), pinnedframes(0), waiters(0), waitingpins(0) {}
+  ~CacheShard() { delete policy; }
 };
 
 
@@ -22,63 +81,303 @@ struct cache_compare_lessthan {
 //
 // Write Back
 // Write Allocate
+//
+// The replacement policy is chosen when the cache is constructed,
+// LRU unless told otherwise (see cachepolicy.h).
+//
+// The cache may be used from several threads at once.  Frames are
+// split into numshards shards by block number, in stripes of
+// SHARD_STRIPE consecutive blocks so that runs of adjacent blocks
+// mostly share a shard, and each shard has its own latch and its
+// own policy.  The disk, which only takes one request at a time
+// anyway, has a latch of its own, always taken after a shard's.
+// Statistics are atomic.  Attach, Detach and the Set* calls must
+// not overlap with anything else.  Callers are responsible for
+// keeping writers of the same data apart, eg, BTreeIndex supports
+// concurrent lookups but not lookups concurrent with changes.
+//
+// Simulated time is shared.  A request goes to the disk when the
+// disk is free and curtime only ever moves forward, to the latest
+// time any thread has waited for, so with several threads it is
+// the makespan of the whole run.
+//
+// Frame data lives in one arena of cachesize frames allocated at the
+// first Attach, each frame aligned to a cache line and the arena to
+// a page (or a huge page, with SetHugePages).  A disk doing direct I/O
+// gets frames aligned to its GetIOAlignment(), if that is more.
+//
+// Blocks read with ACCESS_SEQUENTIAL_ONCE live in a ring of at most
+// ringsize frames that is recycled in FIFO order.  Ring frames are
+// also the first to go when anyone else needs a frame.  A normal
+// access to a ring frame hands it over to the policy.
+//
+// Dirty blocks go to disk in runs of adjacent blocks, one disk
+// request per run.  Evicting a dirty block takes its dirty
+// neighbors along, Detach writes everything as runs, and with
+// SetDirtyRatio, once more than that fraction of a shard is dirty a
+// write-behind flusher writes the coldest runs in the background
+// until half that is left.  It is off by default.
+//
+// With SetWarmManifest, Detach writes the numbers of the hottest
+// resident blocks to filestem.warm next to the disk's files, and
+// Attach reads them back in, in block (ie, track) order with one
+// disk request per run of adjacent blocks, so a new process does not
+// start cold.  The manifest is only a hint; the data always comes
+// from the disk.
+//
+// With SetVictimCache, clean blocks the policy evicts are kept
+// compressed in a second tier with the memory of that many frames (see
+// victimcache.h), and a miss that finds its block there is served
+// from memory instead of the disk.  Scan ring frames are not kept.
+//
+// With TrackMissRatio the cache also follows the LRU stack distance
+// of every reference, to estimate the miss ratio it would have at
+// other sizes (see missratio.h).  The estimate is for one LRU cache
+// of that size, whatever the policy and number of shards.
+//
+// With SetElevatorWindow, when the victim the policy picks is dirty,
+// the policy's next few choices (up to the window in all) are looked
+// at without disturbing it, and the dirty one the head can get to
+// soonest is evicted instead.  Write-behind
+// and Detach issue their runs in one C-LOOK sweep from the head.
+//
+// Every disk request goes into the disk's queue (see
+// DiskSystem::SetQueueDepth) at curtime.  Prefetches, read-ahead
+// windows and write-behind runs are left there, and the foreground
+// only waits for them when the disk serves them ahead of its own
+// requests or it needs a block they bring in.
+//
+// READAHEAD_TRIGGER misses in a row, each on the block right after
+// the previous miss (or after the last block read ahead), are taken
+// as a sequential stream.  The blocks after it are then read ahead
+// in the background, in one disk request per window, starting with
+// READAHEAD_INITIAL blocks and doubling each time the stream goes
+// on, up to SetReadAhead's maximum (0, so off, by default).  A
+// window stops short at the end of the track, at the first block
+// already in the cache or with no clean frame to go in, and never
+// takes more than a quarter of a shard (or, for a scan, more than its
+// ring).  There is only one stream, so misses from several threads at
+// once mostly look random.
+//
+// When the disk has an async backend (DiskSystem::SetAsync), the
+// real I/O of prefetches, read-ahead windows and write-behind runs
+// is only submitted, and left in flight on the frames.  Anything
+// that touches a frame's data first waits for it, so pins, eviction
+// and Detach see the I/O done.  A background write that fails
+// leaves its frames dirty, to be written again, and a background
+// read that fails shows up as the error of the pin that wanted the
+// block.  Simulated time is charged the same either way.
+//
+#define SHARD_STRIPE 8
+#define READAHEAD_TRIGGER 3
+#define READAHEAD_INITIAL 2
+
 class BufferCache {
  private:
   DiskSystem *disk;
   SIZE_T cachesize;
-  map<SIZE_T, Block, cache_compare_lessthan> blockmap;
-  double curtime;
-  SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  vector<CacheShard *> shards;
+  BYTE_T *arena;
+  size_t arenabytes;
+  size_t framestride;
+  bool hugepages;
+  bool warmmanifest;
+  double hotquota;
+  double dirtyratio;
+  SIZE_T elevatorwindow;
+  SIZE_T prefetchdepth;
+  SIZE_T readaheadmax;
+
+  // the rest is the disk's, and protected by disklatch
+  mutable mutex disklatch;
+  list<DiskTicket> prefetchqueue;  // prefetches that may still be in flight
+  SIZE_T ranext;               // the miss that would continue the stream
+  SIZE_T rarun;                // misses in a row that continued it
+  SIZE_T rawindow;             // blocks in the stream's last window, 0 if none
+
+  // taken after a shard's latch, and never with disklatch
+  mutable mutex mrclatch;
+  StackDistanceTracker *mrc;
+
+  // likewise
+  mutable mutex victimlatch;
+  SIZE_T victimframes;
+  CompressedVictimCache *victims;
+
+  atomic<double> curtime;
+  atomic<SIZE_T> allocs, deallocs, reads, writes, diskreads, diskwrites;
+  atomic<SIZE_T> prefetches;
+  atomic<SIZE_T> readaheads;
+  atomic<SIZE_T> victimhits;
+  atomic<SIZE_T> writeruns;
+  atomic<SIZE_T> warmblocks;
+  atomic<SIZE_T> asyncios, asyncfailures;
+  function<void(const IORequest &)> iodone;
  protected:
-  ERROR_T CheckDeleteOldest();
+  CacheShard  &ShardOf(const SIZE_T blocknum) const;
+  void         AdvanceTime(const double t);
+  void         WaitForDisk(const DiskTicket &t);
+  bool         Arrived(BufferFrame *f);
+  void         RetirePrefetches();
+  ERROR_T      DiskRead(BufferFrame *f, const bool background);
+  ERROR_T      WaitIO(CacheShard &s, BufferFrame *f);
+  SIZE_T       SequentialMiss(const CacheShard &s, const SIZE_T blocknum, const AccessHint hint);
+  void         ReadAhead(const SIZE_T first, const SIZE_T numblocks, const AccessHint hint);
+  ERROR_T      AllocateArena();
+  void         FreeArena();
+  BufferFrame *NewFrame(CacheShard &s, const SIZE_T blocknum);
+  void         DeleteFrame(CacheShard &s, BufferFrame *f);
+  void         Touch(CacheShard &s, BufferFrame *f);
+  void         Adopt(CacheShard &s, BufferFrame *f, const AccessHint hint);
+  void         Drop(CacheShard &s, BufferFrame *f);
+  void         Evict(CacheShard &s, BufferFrame *f);
+  bool         TakeVictim(const SIZE_T blocknum, BYTE_T *data);
+  void         ForgetVictim(const SIZE_T blocknum, const SIZE_T num=1);
+  void         MakeHot(CacheShard &s, BufferFrame *f, const bool hot);
+  bool         IsFull(const CacheShard &s, const AccessHint hint) const;
+  BufferFrame *FindRingVictim(CacheShard &s, const bool inflight);
+  BufferFrame *FindVictim(CacheShard &s, const SIZE_T incoming, const AccessHint hint);
+  BufferFrame *Elevator(CacheShard &s, const SIZE_T incoming, BufferFrame *oldest);
+  SIZE_T       SweepDistance(const SIZE_T head, const SIZE_T blocknum) const;
+  SIZE_T       GetHeadBlock() const;
+  void         MarkDirty(CacheShard &s, BufferFrame *f);
+  ERROR_T      WriteRun(CacheShard &s, const vector<BufferFrame *> &run, const bool background);
+  ERROR_T      WriteBack(CacheShard &s, BufferFrame *f);
+  ERROR_T      WriteBehind(CacheShard &s);
+  ERROR_T      CheckDeleteOldest(CacheShard &s, const SIZE_T incoming, const AccessHint hint);
+  bool         NoFrame(const CacheShard &s, const AccessHint hint) const;
+  bool         WaitForFrame(CacheShard &s, unique_lock<mutex> &l);
+  void         FrameFreed(CacheShard &s);
+  ERROR_T      Reset();
+  string       GetManifestName() const;
+  ERROR_T      WriteManifest();
+  ERROR_T      WarmUp();
  public:
   // Cache size is in number of blocks
+  // policy is one of CACHE_POLICY_NAMES, anything else throws
+  // numshards is capped at cachesize
   BufferCache(DiskSystem *disk,
-	      const SIZE_T cachesize);
+	      const SIZE_T cachesize,
+	      const string &policy="lru",
+	      const SIZE_T numshards=1);
   BufferCache() { throw 0; }
   BufferCache(const BufferCache &rhs) { throw 0; } 
   BufferCache & operator=(const BufferCache &rhs) { throw 0; return *this; } 
   ~BufferCache();
 
+  // Back the arena with transparent huge pages where the system
+  // has them.  Takes effect at the next Attach that allocates it.
+  void    SetHugePages(const bool on) { hugepages=on; }
+  // Write a warm-up manifest at Detach and load it at Attach
+  void    SetWarmManifest(const bool on) { warmmanifest=on; }
+
   // Call Attach before your first read or write
   // Call Detach after your last read or write
+  // Every pinned block must be unpinned before Detach
   ERROR_T Attach();
   ERROR_T Detach();
+  // Write every dirty block back and sync the disk, bitmap and all,
+  // keeping what is cached.  Blocks pinned meanwhile are written as
+  // they are.
+  ERROR_T Sync();
 
   // Number of blocks in the cache
   SIZE_T GetCacheSize() const;
+  SIZE_T GetNumShards() const { return shards.size(); }
   // Number of bytes per block
   SIZE_T GetBlockSize() const;
   // Number of blocks in the underlying device
   SIZE_T GetNumBlocks() const;
   // Current time in the simulation (starts at zero)
   double GetCurrentTime() const;
+  // Bytes of frame memory, the arena plus per frame bookkeeping,
+  // and whatever the victim cache holds
+  size_t GetMemoryUsage() const;
+  // Name of the replacement policy
+  const char *GetPolicyName() const;
+
+  // Used by the replacement policy: may this block be evicted?
+  bool  CanEvict(const SIZE_T blocknum) const;
 
   // outblocknum is the number of the block that we just allocated
-  // if the error return is nonzero
-  ERROR_T NotifyAllocateBlock(const SIZE_T outblocknum);
+  // if the error return is nonzero, num the blocks from it on
+  ERROR_T NotifyAllocateBlock(const SIZE_T outblocknum, const SIZE_T num=1);
   // inblocknum is the block that we just deallocated
-  ERROR_T NotifyDeallocateBlock(const SIZE_T inblocknum);
+  ERROR_T NotifyDeallocateBlock(const SIZE_T inblocknum, const SIZE_T num=1);
   // check to see if we think the block was allocated
   bool  IsBlockAllocated(const SIZE_T inblocknum);
+  // the first run of num blocks at or after from that the disk
+  // thinks are free, ERROR_NOSPACE if there is none
+  ERROR_T FindFreeBlocks(const SIZE_T num, SIZE_T &block, const SIZE_T from=0);
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK or other nonzero error codes
-  ERROR_T ReadBlock(const SIZE_T inblocknum, Block &outblock);
+  ERROR_T ReadBlock(const SIZE_T inblocknum, Block &outblock,
+		    const AccessHint hint=ACCESS_NORMAL);
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK
   // ERROR_WRONGSIZEBLOCK or other nonzero error codes
   ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock);
+
+  // Pin a block in the cache and return a pointer to the frame's
+  // GetBlockSize() bytes.  The pointer stays valid, and the frame
+  // is never evicted, until the matching UnpinBlock.  Pins nest.
+  // A pin counts as a read.  With fill=false the caller promises
+  // to overwrite the whole block, so a miss does not go to disk and
+  // the pin is not counted as a read.
+  // returns one of ERROR_NOERROR  (zero)
+  // ERROR_NOMEM if every frame is pinned or other nonzero error codes
+  ERROR_T PinBlock(const SIZE_T blocknum, BYTE_T *&data, const bool fill=true,
+		   const AccessHint hint=ACCESS_NORMAL);
+
+  // dirty=true means the block was changed through the pointer,
+  // and counts as a write
+  // returns one of ERROR_NOERROR  (zero)
+  // ERROR_NONEXISTENT if the block is not pinned
+  ERROR_T UnpinBlock(const SIZE_T blocknum, const bool dirty=false);
   
+  // Change whether a resident block is kept hot, eg, once its
+  // contents show it is wanted on every lookup.  Asking for more
+  // than the quota is not an error, the block just stays normal.
+  // A block passing through the scan ring is left alone.
+  // returns one of ERROR_NOERROR  (zero)
+  // ERROR_NONEXISTENT if the block is not in the cache
+  ERROR_T SetKeepHot(const SIZE_T blocknum, const bool hot);
+
   // Request that a block be read into the cache
   // This returns immediately.
   // ERROR_NOFETCH means that there is no room currently
   // to prefetch the block and it was not prefetched.
-  ERROR_T PrefetchBlock (const SIZE_T blocknum);
+  ERROR_T PrefetchBlock (const SIZE_T blocknum,
+			 const AccessHint hint=ACCESS_NORMAL);
+
+  // Maximum number of prefetches in flight at once
+  void    SetPrefetchDepth(const SIZE_T depth) { prefetchdepth=depth; }
+  // Largest readahead window in blocks, 0 turns readahead off
+  void    SetReadAhead(const SIZE_T maxwindow) { readaheadmax=maxwindow; }
+  // Fraction of the cache allowed to be dirty before write-behind
+  // starts, 1 turns it off
+  void    SetDirtyRatio(const double ratio) { dirtyratio=ratio; }
+  // How many of the policy's choices the elevator may pick from,
+  // 1 turns it off
+  void    SetElevatorWindow(const SIZE_T window) { elevatorwindow = window>0 ? window : 1; }
+  // Number of frames a sequential scan may use in each shard, at least one
+  void    SetRingSize(const SIZE_T size);
+  // Fraction of each shard's frames that may be kept hot, 0 means
+  // KEEP_HOT is treated as NORMAL
+  void    SetHotQuota(const double fraction) { hotquota=fraction; }
+  // Keep evicted clean blocks compressed in as much memory as
+  // frames uncompressed blocks would take, 0 turns it off.  Takes
+  // effect at the next Attach.
+  void    SetVictimCache(const SIZE_T frames);
+  // Estimate the miss ratio of LRU caches of up to maxdepth blocks,
+  // 0 turns it off
+  void    TrackMissRatio(const SIZE_T maxdepth);
   
   // Request that a block be flushed to disk
   // Note that this blocks until the block is finished.
+  // A pinned block is written but stays in the cache.
   ERROR_T FlushBlock(const SIZE_T blocknum);
   
  
@@ -88,6 +387,24 @@ class BufferCache {
   SIZE_T GetNumWrites() const { return writes;}
   SIZE_T GetNumDiskReads() const { return diskreads;}
   SIZE_T GetNumDiskWrites() const { return diskwrites;}
+  SIZE_T GetNumPrefetches() const { return prefetches;}
+  // Blocks read ahead of sequential misses, also counted as disk reads
+  SIZE_T GetNumReadAheads() const { return readaheads;}
+  // Misses served from the compressed victim cache, not counted as disk reads
+  SIZE_T GetNumVictimHits() const { return victimhits;}
+  // Disk write requests, each covering a run of one or more blocks
+  SIZE_T GetNumWriteRuns() const { return writeruns;}
+  // Blocks read in from the warm-up manifest, also counted as disk reads
+  SIZE_T GetNumWarmBlocks() const { return warmblocks;}
+  // Requests left to finish in the background, and how many failed
+  SIZE_T GetNumAsyncIOs() const { return asyncios;}
+  SIZE_T GetNumAsyncFailures() const { return asyncfailures;}
+  // Estimated fraction of reads an LRU cache of size blocks would
+  // have missed, -1 unless tracking covers that size
+  double GetEstimatedMissRatio(const SIZE_T size) const;
+  // size:missratio pairs, the cache's own size among them, or
+  // nothing unless tracking
+  ostream & PrintMissRatioCurve(ostream &os) const;
 
   ostream & Print(ostream &os) const;
   
@@ -0,0 +1,612 @@
+#include <algorithm>
+#include <functional>
+
+#include "cachepolicy.h"
+#include "buffercache.h"
+
+
+ostream & CachePolicy::Print(ostream &os) const
+{
+  os << GetName();
+  return os;
+}
+
+CachePolicy *CachePolicy::Create(const string &name, const SIZE_T cachesize)
+{
+  if (name=="lru") {
+    return new LRUPolicy();
+  } else if (name=="clock") {
+    return new ClockPolicy();
+  } else if (name=="2q") {
+    return new TwoQPolicy(cachesize);
+  } else if (name=="arc") {
+    return new ARCPolicy(cachesize);
+  } else if (name=="lruk") {
+    return new LRUKPolicy(cachesize);
+  } else {
+    return 0;
+  }
+}
+
+bool CachePolicy::IsValidName(const string &name)
+{
+  CachePolicy *p=Create(name,1);
+
+  delete p;
+  return p!=0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// RecencyList
+
+void RecencyList::PushFront(const SIZE_T b)
+{
+  Remove(b);
+  blocks.push_front(b);
+  where[b]=blocks.begin();
+}
+
+bool RecencyList::Remove(const SIZE_T b)
+{
+  unordered_map<SIZE_T, list<SIZE_T>::iterator>::iterator i=where.find(b);
+
+  if (i==where.end()) {
+    return false;
+  }
+  blocks.erase((*i).second);
+  where.erase(i);
+  return true;
+}
+
+bool RecencyList::PopBack(SIZE_T &b)
+{
+  if (blocks.empty()) {
+    return false;
+  }
+  b=blocks.back();
+  where.erase(b);
+  blocks.pop_back();
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// LRU
+
+void LRUPolicy::Touch(const SIZE_T blocknum, const double now)
+{
+  unordered_map<SIZE_T, Bucket *>::iterator i=bucketof.find(blocknum);
+
+  if (i!=bucketof.end() && (*i).second==newest && newest->time==now) {
+    return;
+  }
+
+  Remove(blocknum);
+
+  if (!newest || newest->time!=now) {
+    Bucket *nb=new Bucket(now);
+    nb->older=newest;
+    if (newest) {
+      newest->newer=nb;
+    } else {
+      oldest=nb;
+    }
+    newest=nb;
+  }
+
+  newest->members.push_back(blocknum);
+  if (newest->heaped) {
+    push_heap(newest->members.begin(),newest->members.end(),greater<SIZE_T>());
+  }
+  newest->live++;
+  bucketof[blocknum]=newest;
+}
+
+// Take a block out of its bucket, dropping the bucket once it is empty
+// Its entry in members is left behind and skipped later as stale
+void LRUPolicy::Remove(const SIZE_T blocknum)
+{
+  unordered_map<SIZE_T, Bucket *>::iterator i=bucketof.find(blocknum);
+
+  if (i==bucketof.end()) {
+    return;
+  }
+
+  Bucket *b=(*i).second;
+
+  bucketof.erase(i);
+  if (--b->live>0) {
+    return;
+  }
+  if (b->newer) {
+    b->newer->older=b->older;
+  } else {
+    newest=b->older;
+  }
+  if (b->older) {
+    b->older->newer=b->newer;
+  } else {
+    oldest=b->newer;
+  }
+  delete b;
+}
+
+// Blocks the cache won't give up are passed over, so this may
+// look past the oldest bucket
+bool LRUPolicy::ChooseVictim(const SIZE_T incoming, const BufferCache &cache, SIZE_T &victim)
+{
+  for (Bucket *b=oldest; b; b=b->newer) {
+    vector<SIZE_T> skipped;
+    bool found=false;
+
+    // A bucket is heapified once, the first time we evict from it
+    if (!b->heaped) {
+      make_heap(b->members.begin(),b->members.end(),greater<SIZE_T>());
+      b->heaped=true;
+    }
+
+    while (!b->members.empty()) {
+      SIZE_T candidate=b->members.front();
+      unordered_map<SIZE_T, Bucket *>::const_iterator i=bucketof.find(candidate);
+      if (i!=bucketof.end() && (*i).second==b) {
+	if (cache.CanEvict(candidate)) {
+	  victim=candidate;
+	  found=true;
+	  break;
+	}
+	skipped.push_back(candidate);
+      }
+      pop_heap(b->members.begin(),b->members.end(),greater<SIZE_T>());
+      b->members.pop_back();
+    }
+
+    for (vector<SIZE_T>::const_iterator i=skipped.begin(); i!=skipped.end(); ++i) {
+      b->members.push_back(*i);
+      push_heap(b->members.begin(),b->members.end(),greater<SIZE_T>());
+    }
+
+    if (found) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The same order ChooseVictim takes them in, walked down each bucket's
+// heap from the top, so only about num of its members are looked at
+void LRUPolicy::Candidates(const SIZE_T incoming, const BufferCache &cache, const SIZE_T num, vector<SIZE_T> &candidates) const
+{
+  for (Bucket *b=oldest; b && candidates.size()<num; b=b->newer) {
+    if (!b->heaped) {
+      make_heap(b->members.begin(),b->members.end(),greater<SIZE_T>());
+      b->heaped=true;
+    }
+
+    // positions in members still to look at, smallest block first
+    vector<pair<SIZE_T, SIZE_T> > frontier;  // (block, position)
+    bool any=false;
+    SIZE_T last=0;
+
+    if (!b->members.empty()) {
+      frontier.push_back(pair<SIZE_T, SIZE_T>(b->members[0],0));
+    }
+    while (!frontier.empty() && candidates.size()<num) {
+      pop_heap(frontier.begin(),frontier.end(),greater<pair<SIZE_T, SIZE_T> >());
+      SIZE_T block=frontier.back().first;
+      SIZE_T pos=frontier.back().second;
+      frontier.pop_back();
+
+      for (SIZE_T c=2*pos+1; c<=2*pos+2 && c<b->members.size(); c++) {
+	frontier.push_back(pair<SIZE_T, SIZE_T>(b->members[c],c));
+	push_heap(frontier.begin(),frontier.end(),greater<pair<SIZE_T, SIZE_T> >());
+      }
+
+      // a block can be in members again after a stale entry of its own
+      if (any && block==last) {
+	continue;
+      }
+      unordered_map<SIZE_T, Bucket *>::const_iterator j=bucketof.find(block);
+      if (j!=bucketof.end() && (*j).second==b) {
+	any=true;
+	last=block;
+	if (cache.CanEvict(block)) {
+	  candidates.push_back(block);
+	}
+      }
+    }
+  }
+}
+
+void LRUPolicy::Clear()
+{
+  while (oldest) {
+    Bucket *b=oldest;
+    oldest=b->newer;
+    delete b;
+  }
+  newest=0;
+  bucketof.clear();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// CLOCK
+
+void ClockPolicy::Insert(const SIZE_T blocknum, const double now)
+{
+  SIZE_T slot;
+
+  if (freeslots.empty()) {
+    slot=slotblock.size();
+    slotblock.push_back(blocknum);
+    slotref.push_back(false);
+    slotused.push_back(true);
+  } else {
+    slot=freeslots.back();
+    freeslots.pop_back();
+    slotblock[slot]=blocknum;
+    slotused[slot]=true;
+  }
+  // a new block starts without its reference bit, so it is the
+  // first to go if it is never used again
+  slotref[slot]=false;
+  slotof[blocknum]=slot;
+}
+
+void ClockPolicy::Touch(const SIZE_T blocknum, const double now)
+{
+  unordered_map<SIZE_T, SIZE_T>::const_iterator i=slotof.find(blocknum);
+
+  if (i!=slotof.end()) {
+    slotref[(*i).second]=true;
+  }
+}
+
+void ClockPolicy::Remove(const SIZE_T blocknum)
+{
+  unordered_map<SIZE_T, SIZE_T>::iterator i=slotof.find(blocknum);
+
+  if (i==slotof.end()) {
+    return;
+  }
+  slotused[(*i).second]=false;
+  slotref[(*i).second]=false;
+  freeslots.push_back((*i).second);
+  slotof.erase(i);
+}
+
+bool ClockPolicy::ChooseVictim(const SIZE_T incoming, const BufferCache &cache, SIZE_T &victim)
+{
+  SIZE_T n=slotblock.size();
+
+  // two full sweeps clear every reference bit, so a third finds
+  // a victim if there is one
+  for (SIZE_T i=0; i<3*n; i++) {
+    SIZE_T slot=hand;
+    hand=(hand+1)%n;
+    if (!slotused[slot]) {
+      continue;
+    }
+    if (slotref[slot]) {
+      slotref[slot]=false;
+      continue;
+    }
+    if (cache.CanEvict(slotblock[slot])) {
+      victim=slotblock[slot];
+      return true;
+    }
+  }
+  return false;
+}
+
+// The blocks without their reference bit come first, from the hand
+// on, and then those that would get a second chance
+void ClockPolicy::Candidates(const SIZE_T incoming, const BufferCache &cache, const SIZE_T num, vector<SIZE_T> &candidates) const
+{
+  SIZE_T n=slotblock.size();
+
+  for (int pass=0; pass<2; pass++) {
+    for (SIZE_T i=0; i<n && candidates.size()<num; i++) {
+      SIZE_T slot=(hand+i)%n;
+      if (slotused[slot] && slotref[slot]==(pass==1) && cache.CanEvict(slotblock[slot])) {
+	candidates.push_back(slotblock[slot]);
+      }
+    }
+  }
+}
+
+void ClockPolicy::Clear()
+{
+  slotblock.clear();
+  slotref.clear();
+  slotused.clear();
+  freeslots.clear();
+  slotof.clear();
+  hand=0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// 2Q
+
+TwoQPolicy::TwoQPolicy(const SIZE_T cachesize)
+{
+  // the tuning suggested in the paper
+  kin=cachesize/4;
+  kout=cachesize/2;
+  if (kin<1) { kin=1; }
+  if (kout<1) { kout=1; }
+}
+
+void TwoQPolicy::Insert(const SIZE_T blocknum, const double now)
+{
+  if (a1out.Remove(blocknum)) {
+    // seen recently enough to be worth keeping
+    am.PushFront(blocknum);
+  } else {
+    a1in.PushFront(blocknum);
+  }
+}
+
+void TwoQPolicy::Touch(const SIZE_T blocknum, const double now)
+{
+  // references while in A1in are considered correlated and ignored
+  if (am.Contains(blocknum)) {
+    am.PushFront(blocknum);
+  }
+}
+
+void TwoQPolicy::Remove(const SIZE_T blocknum)
+{
+  SIZE_T ghost;
+
+  if (a1in.Remove(blocknum)) {
+    a1out.PushFront(blocknum);
+    while (a1out.Size()>kout) {
+      a1out.PopBack(ghost);
+    }
+  } else {
+    am.Remove(blocknum);
+  }
+}
+
+static bool OldestEvictable(const RecencyList &l, const BufferCache &cache, SIZE_T &victim)
+{
+  for (RecencyList::oldest_iterator i=l.OldestBegin(); i!=l.OldestEnd(); ++i) {
+    if (cache.CanEvict(*i)) {
+      victim=*i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void OldestEvictables(const RecencyList &l, const BufferCache &cache, const SIZE_T num, vector<SIZE_T> &candidates)
+{
+  for (RecencyList::oldest_iterator i=l.OldestBegin(); i!=l.OldestEnd() && candidates.size()<num; ++i) {
+    if (cache.CanEvict(*i)) {
+      candidates.push_back(*i);
+    }
+  }
+}
+
+bool TwoQPolicy::ChooseVictim(const SIZE_T incoming, const BufferCache &cache, SIZE_T &victim)
+{
+  if (a1in.Size()>kin) {
+    return OldestEvictable(a1in,cache,victim) || OldestEvictable(am,cache,victim);
+  } else {
+    return OldestEvictable(am,cache,victim) || OldestEvictable(a1in,cache,victim);
+  }
+}
+
+void TwoQPolicy::Candidates(const SIZE_T incoming, const BufferCache &cache, const SIZE_T num, vector<SIZE_T> &candidates) const
+{
+  if (a1in.Size()>kin) {
+    OldestEvictables(a1in,cache,num,candidates);
+    OldestEvictables(am,cache,num,candidates);
+  } else {
+    OldestEvictables(am,cache,num,candidates);
+    OldestEvictables(a1in,cache,num,candidates);
+  }
+}
+
+void TwoQPolicy::Clear()
+{
+  a1in.Clear();
+  a1out.Clear();
+  am.Clear();
+}
+
+ostream & TwoQPolicy::Print(ostream &os) const
+{
+  os << "2q(kin="<<kin<<", kout="<<kout<<", a1in="<<a1in.Size()
+     << ", a1out="<<a1out.Size()<<", am="<<am.Size()<<")";
+  return os;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// ARC
+
+void ARCPolicy::Miss(const SIZE_T blocknum)
+{
+  double delta;
+
+  if (b1.Contains(blocknum)) {
+    delta = b1.Size()>=b2.Size() ? 1 : (double)b2.Size()/(double)b1.Size();
+    p = (p+delta>c) ? c : p+delta;
+  } else if (b2.Contains(blocknum)) {
+    delta = b2.Size()>=b1.Size() ? 1 : (double)b1.Size()/(double)b2.Size();
+    p = (p-delta<0) ? 0 : p-delta;
+  }
+}
+
+void ARCPolicy::Insert(const SIZE_T blocknum, const double now)
+{
+  SIZE_T ghost;
+
+  if (b1.Remove(blocknum) || b2.Remove(blocknum)) {
+    t2.PushFront(blocknum);
+  } else {
+    t1.PushFront(blocknum);
+  }
+
+  // keep the directory at most c for L1 and 2c overall
+  while (t1.Size()+b1.Size()>c && b1.PopBack(ghost)) {
+  }
+  while (t1.Size()+t2.Size()+b1.Size()+b2.Size()>2*c && b2.PopBack(ghost)) {
+  }
+}
+
+void ARCPolicy::Touch(const SIZE_T blocknum, const double now)
+{
+  if (t1.Remove(blocknum) || t2.Contains(blocknum)) {
+    t2.PushFront(blocknum);
+  }
+}
+
+void ARCPolicy::Remove(const SIZE_T blocknum)
+{
+  if (t1.Remove(blocknum)) {
+    b1.PushFront(blocknum);
+  } else if (t2.Remove(blocknum)) {
+    b2.PushFront(blocknum);
+  }
+}
+
+bool ARCPolicy::ChooseVictim(const SIZE_T incoming, const BufferCache &cache, SIZE_T &victim)
+{
+  bool fromt1 = t1.Size()>0 &&
+    ((double)t1.Size()>p || (b2.Contains(incoming) && (double)t1.Size()==p));
+
+  if (fromt1) {
+    return OldestEvictable(t1,cache,victim) || OldestEvictable(t2,cache,victim);
+  } else {
+    return OldestEvictable(t2,cache,victim) || OldestEvictable(t1,cache,victim);
+  }
+}
+
+void ARCPolicy::Candidates(const SIZE_T incoming, const BufferCache &cache, const SIZE_T num, vector<SIZE_T> &candidates) const
+{
+  bool fromt1 = t1.Size()>0 &&
+    ((double)t1.Size()>p || (b2.Contains(incoming) && (double)t1.Size()==p));
+
+  if (fromt1) {
+    OldestEvictables(t1,cache,num,candidates);
+    OldestEvictables(t2,cache,num,candidates);
+  } else {
+    OldestEvictables(t2,cache,num,candidates);
+    OldestEvictables(t1,cache,num,candidates);
+  }
+}
+
+void ARCPolicy::Clear()
+{
+  t1.Clear();
+  t2.Clear();
+  b1.Clear();
+  b2.Clear();
+  p=0;
+}
+
+ostream & ARCPolicy::Print(ostream &os) const
+{
+  os << "arc(c="<<c<<", p="<<p<<", t1="<<t1.Size()<<", t2="<<t2.Size()
+     << ", b1="<<b1.Size()<<", b2="<<b2.Size()<<")";
+  return os;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// LRU-K
+
+// Blocks with fewer than k references rank as if their kth
+// reference were at time zero, ie, infinitely long ago
+LRUKPolicy::RankKey LRUKPolicy::Rank(const SIZE_T blocknum) const
+{
+  const vector<SIZE_T> &refs=history.find(blocknum)->second.refs;
+  SIZE_T kth = refs.size()<k ? 0 : refs[k-1];
+
+  return RankKey(pair<SIZE_T, SIZE_T>(kth,refs[0]),blocknum);
+}
+
+void LRUKPolicy::Reference(const SIZE_T blocknum)
+{
+  vector<SIZE_T> &refs=history[blocknum].refs;
+
+  refs.insert(refs.begin(),++clock);
+  if (refs.size()>k) {
+    refs.pop_back();
+  }
+
+  unordered_map<SIZE_T, RankKey>::iterator i=rankof.find(blocknum);
+  if (i!=rankof.end()) {
+    ranked.erase((*i).second);
+  }
+  RankKey r=Rank(blocknum);
+  ranked.insert(r);
+  rankof[blocknum]=r;
+}
+
+void LRUKPolicy::Insert(const SIZE_T blocknum, const double now)
+{
+  // if it is coming back, it is no longer just retained history
+  evicted.Remove(blocknum);
+  Reference(blocknum);
+}
+
+void LRUKPolicy::Touch(const SIZE_T blocknum, const double now)
+{
+  if (rankof.find(blocknum)!=rankof.end()) {
+    Reference(blocknum);
+  }
+}
+
+void LRUKPolicy::Remove(const SIZE_T blocknum)
+{
+  unordered_map<SIZE_T, RankKey>::iterator i=rankof.find(blocknum);
+
+  if (i==rankof.end()) {
+    return;
+  }
+  ranked.erase((*i).second);
+  rankof.erase(i);
+
+  // retain its history for a while in case it comes back
+  SIZE_T old;
+
+  evicted.PushFront(blocknum);
+  while (evicted.Size()>retained && evicted.PopBack(old)) {
+    history.erase(old);
+  }
+}
+
+bool LRUKPolicy::ChooseVictim(const SIZE_T incoming, const BufferCache &cache, SIZE_T &victim)
+{
+  for (set<RankKey>::const_iterator i=ranked.begin(); i!=ranked.end(); ++i) {
+    if (cache.CanEvict((*i).second)) {
+      victim=(*i).second;
+      return true;
+    }
+  }
+  return false;
+}
+
+void LRUKPolicy::Candidates(const SIZE_T incoming, const BufferCache &cache, const SIZE_T num, vector<SIZE_T> &candidates) const
+{
+  for (set<RankKey>::const_iterator i=ranked.begin(); i!=ranked.end() && candidates.size()<num; ++i) {
+    if (cache.CanEvict((*i).second)) {
+      candidates.push_back((*i).second);
+    }
+  }
+}
+
+void LRUKPolicy::Clear()
+{
+  history.clear();
+  evicted.Clear();
+  rankof.clear();
+  ranked.clear();
+  clock=0;
+}
@@ -0,0 +1,245 @@
+#ifndef _cachepolicy
+#define _cachepolicy
+
+#include <iostream>
+#include <string>
+#include <list>
+#include <set>
+#include <vector>
+#include <unordered_map>
+
+#include "global.h"
+
+using namespace std;
+
+class BufferCache;
+
+#define CACHE_POLICY_NAMES "lru|clock|2q|arc|lruk"
+
+//
+// Replacement policy used by the buffer cache
+//
+// The cache tells the policy about every block that comes in,
+// is referenced, or leaves, and asks it for a victim when it is
+// full.  Victims must be blocks the cache is willing to give up
+// (see BufferCache::CanEvict), eg, not pinned.
+//
+// The hit ratio of any policy is available from the cache as
+// 1 - GetNumDiskReads()/GetNumReads()
+//
+class CachePolicy {
+ public:
+  virtual ~CachePolicy() {}
+
+  // A miss on blocknum is about to be serviced
+  virtual void Miss(const SIZE_T blocknum) {}
+  // blocknum was brought into the cache
+  virtual void Insert(const SIZE_T blocknum, const double now)=0;
+  // A resident blocknum was referenced
+  virtual void Touch(const SIZE_T blocknum, const double now)=0;
+  // blocknum has left the cache
+  virtual void Remove(const SIZE_T blocknum)=0;
+  // Choose a block to evict to make room for incoming
+  // returns false if nothing can be evicted
+  virtual bool ChooseVictim(const SIZE_T incoming,
+			    const BufferCache &cache,
+			    SIZE_T &victim)=0;
+  // Up to num blocks the cache could evict, in the order
+  // ChooseVictim would come to them, without changing anything
+  virtual void Candidates(const SIZE_T incoming,
+			  const BufferCache &cache,
+			  const SIZE_T num,
+			  vector<SIZE_T> &candidates) const=0;
+  // Forget everything
+  virtual void Clear()=0;
+
+  virtual const char *GetName() const=0;
+  virtual ostream & Print(ostream &os) const;
+
+  // returns 0 if name is not one of CACHE_POLICY_NAMES
+  static CachePolicy *Create(const string &name, const SIZE_T cachesize);
+  static bool IsValidName(const string &name);
+};
+
+inline ostream & operator<<(ostream &os, const CachePolicy &p) { return p.Print(os); }
+
+
+//
+// A list of block numbers in recency order with O(1) lookup,
+// used by most of the policies below
+//
+class RecencyList {
+ private:
+  list<SIZE_T> blocks;  // front is most recent
+  unordered_map<SIZE_T, list<SIZE_T>::iterator> where;
+ public:
+  typedef list<SIZE_T>::const_reverse_iterator oldest_iterator;
+
+  bool   Contains(const SIZE_T b) const { return where.find(b)!=where.end(); }
+  SIZE_T Size() const { return where.size(); }
+  void   PushFront(const SIZE_T b);
+  bool   Remove(const SIZE_T b);
+  bool   PopBack(SIZE_T &b);
+  void   Clear() { blocks.clear(); where.clear(); }
+  oldest_iterator OldestBegin() const { return blocks.rbegin(); }
+  oldest_iterator OldestEnd() const { return blocks.rend(); }
+};
+
+
+//
+// Least recently used
+//
+// Simulated time only advances on disk operations, so every
+// block touched at the same time shares a bucket.  The victim is
+// the lowest numbered block in the oldest bucket, which is the
+// least recently accessed block with ties broken by block number.
+// Buckets are heapified lazily, so eviction is amortized
+// O(log bucket size) and everything else is O(1).
+//
+class LRUPolicy : public CachePolicy {
+ private:
+  struct Bucket {
+    double          time;
+    SIZE_T          live;      // blocks currently in this bucket
+    // heaping members does not change what it holds, so Candidates may
+    mutable vector<SIZE_T>  members;   // block numbers, may include stale entries
+    mutable bool    heaped;    // members is a min-heap by block number
+    Bucket         *newer;
+    Bucket         *older;
+
+    Bucket(const double t) : time(t), live(0), heaped(false), newer(0), older(0) {}
+  };
+
+  unordered_map<SIZE_T, Bucket *> bucketof;
+  Bucket *newest;
+  Bucket *oldest;
+ public:
+  LRUPolicy() : newest(0), oldest(0) {}
+  virtual ~LRUPolicy() { Clear(); }
+
+  virtual void Insert(const SIZE_T blocknum, const double now) { Touch(blocknum,now); }
+  virtual void Touch(const SIZE_T blocknum, const double now);
+  virtual void Remove(const SIZE_T blocknum);
+  virtual bool ChooseVictim(const SIZE_T incoming, const BufferCache &cache, SIZE_T &victim);
+  virtual void Candidates(const SIZE_T incoming, const BufferCache &cache, const SIZE_T num, vector<SIZE_T> &candidates) const;
+  virtual void Clear();
+  virtual const char *GetName() const { return "lru"; }
+};
+
+
+//
+// CLOCK (second chance)
+//
+class ClockPolicy : public CachePolicy {
+ private:
+  vector<SIZE_T> slotblock;
+  vector<bool>   slotref;
+  vector<bool>   slotused;
+  vector<SIZE_T> freeslots;
+  unordered_map<SIZE_T, SIZE_T> slotof;
+  SIZE_T hand;
+ public:
+  ClockPolicy() : hand(0) {}
+
+  virtual void Insert(const SIZE_T blocknum, const double now);
+  virtual void Touch(const SIZE_T blocknum, const double now);
+  virtual void Remove(const SIZE_T blocknum);
+  virtual bool ChooseVictim(const SIZE_T incoming, const BufferCache &cache, SIZE_T &victim);
+  virtual void Candidates(const SIZE_T incoming, const BufferCache &cache, const SIZE_T num, vector<SIZE_T> &candidates) const;
+  virtual void Clear();
+  virtual const char *GetName() const { return "clock"; }
+};
+
+
+//
+// 2Q (Johnson and Shasha, full version)
+//
+// New blocks enter the A1in FIFO.  Blocks evicted from A1in are
+// remembered in the A1out ghost FIFO, and only a block that is
+// missed again while in A1out is promoted to the Am LRU list.
+//
+class TwoQPolicy : public CachePolicy {
+ private:
+  SIZE_T kin, kout;
+  RecencyList a1in, a1out, am;
+ public:
+  TwoQPolicy(const SIZE_T cachesize);
+
+  virtual void Insert(const SIZE_T blocknum, const double now);
+  virtual void Touch(const SIZE_T blocknum, const double now);
+  virtual void Remove(const SIZE_T blocknum);
+  virtual bool ChooseVictim(const SIZE_T incoming, const BufferCache &cache, SIZE_T &victim);
+  virtual void Candidates(const SIZE_T incoming, const BufferCache &cache, const SIZE_T num, vector<SIZE_T> &candidates) const;
+  virtual void Clear();
+  virtual const char *GetName() const { return "2q"; }
+  virtual ostream & Print(ostream &os) const;
+};
+
+
+//
+// ARC (Megiddo and Modha)
+//
+// T1 holds blocks seen once recently, T2 blocks seen at least
+// twice.  B1 and B2 are their ghosts.  A miss that hits a ghost
+// list moves the target size p of T1 toward that list.
+//
+class ARCPolicy : public CachePolicy {
+ private:
+  SIZE_T c;
+  double p;
+  RecencyList t1, t2, b1, b2;
+
+ public:
+  ARCPolicy(const SIZE_T cachesize) : c(cachesize), p(0) {}
+
+  virtual void Miss(const SIZE_T blocknum);
+  virtual void Insert(const SIZE_T blocknum, const double now);
+  virtual void Touch(const SIZE_T blocknum, const double now);
+  virtual void Remove(const SIZE_T blocknum);
+  virtual bool ChooseVictim(const SIZE_T incoming, const BufferCache &cache, SIZE_T &victim);
+  virtual void Candidates(const SIZE_T incoming, const BufferCache &cache, const SIZE_T num, vector<SIZE_T> &candidates) const;
+  virtual void Clear();
+  virtual const char *GetName() const { return "arc"; }
+  virtual ostream & Print(ostream &os) const;
+};
+
+
+//
+// LRU-K (O'Neil, O'Neil and Weikum) with K=2
+//
+// The victim is the block whose Kth most recent reference is
+// oldest.  Blocks with fewer than K references go first, in LRU
+// order.  Reference history is kept for up to cachesize blocks
+// that have been evicted.  Time is the count of references, since
+// simulated time does not advance on hits.
+//
+class LRUKPolicy : public CachePolicy {
+ private:
+  struct History {
+    vector<SIZE_T> refs;   // most recent first, at most k
+  };
+  typedef pair<pair<SIZE_T, SIZE_T>, SIZE_T> RankKey;  // ((kth, last), block)
+
+  SIZE_T k;
+  SIZE_T clock;
+  SIZE_T retained;
+  unordered_map<SIZE_T, History> history;
+  RecencyList evicted;               // non-resident blocks with history
+  unordered_map<SIZE_T, RankKey> rankof;
+  set<RankKey> ranked;               // resident blocks, best victim first
+
+  RankKey Rank(const SIZE_T blocknum) const;
+  void    Reference(const SIZE_T blocknum);
+ public:
+  LRUKPolicy(const SIZE_T cachesize, const SIZE_T k=2) : k(k), clock(0), retained(cachesize) {}
+
+  virtual void Insert(const SIZE_T blocknum, const double now);
+  virtual void Touch(const SIZE_T blocknum, const double now);
+  virtual void Remove(const SIZE_T blocknum);
+  virtual bool ChooseVictim(const SIZE_T incoming, const BufferCache &cache, SIZE_T &victim);
+  virtual void Candidates(const SIZE_T incoming, const BufferCache &cache, const SIZE_T num, vector<SIZE_T> &candidates) const;
+  virtual void Clear();
+  virtual const char *GetName() const { return "lruk"; }
+};
+
+#endif
@@ -0,0 +1,500 @@
+#include <math.h>
+#include <stdlib.h>
+#include <sstream>
+#include <map>
+
+#include "devicemodel.h"
+
+#define NO_PAGE ((SIZE_T)-1)
+
+
+// Takes name's value out of params, def if it is not there
+static double Param(map<string, double> &params, const string &name, const double def)
+{
+  map<string, double>::iterator i=params.find(name);
+
+  if (i==params.end()) {
+    return def;
+  }
+  double v=(*i).second;
+  params.erase(i);
+  return v;
+}
+
+DeviceModel *DeviceModel::Create(const string &spec, const DiskGeometry &g)
+{
+  istringstream in(spec);
+  string name, param;
+  map<string, double> params;
+
+  in >> name;
+  while (in >> param) {
+    size_t eq=param.find('=');
+    char *end=0;
+    double v=eq==string::npos ? 0 : strtod(param.c_str()+eq+1,&end);
+    if (eq==string::npos || eq+1==param.size() || *end) {
+      cerr << "DeviceModel: "<<param<<" is not name=value"<<endl;
+      return 0;
+    }
+    params[param.substr(0,eq)]=v;
+  }
+
+  DeviceModel *d=0;
+
+  if (name=="disk") {
+    d=new DiskModel(spec,g);
+  } else if (name=="ram") {
+    d=new RAMModel(spec);
+  } else if (name=="ssd") {
+    double channels=Param(params,"channels",8);
+    double read=Param(params,"read",0.05);
+    double program=Param(params,"program",0.5);
+    double erase=Param(params,"erase",3);
+    double pagesperblock=Param(params,"pagesperblock",64);
+    double spare=Param(params,"spare",0.07);
+    if (channels<1 || pagesperblock<1 || read<0 || program<0 || erase<0 || spare<0) {
+      cerr << "DeviceModel: impossible ssd "<<spec<<endl;
+      return 0;
+    }
+    d=new SSDModel(spec,g.numblocks,(SIZE_T)channels,read,program,erase,(SIZE_T)pagesperblock,spare);
+  } else if (name=="raid0" || name=="raid5") {
+    SIZE_T level=name=="raid0" ? 0 : 5;
+    double disks=Param(params,"disks",4);
+    double stripe=Param(params,"stripe",16);
+    if (disks<(level==5 ? 3 : 2) || stripe<1) {
+      cerr << "DeviceModel: impossible "<<name<<" "<<spec<<endl;
+      return 0;
+    }
+    d=new RAIDModel(spec,g,level,(SIZE_T)disks,(SIZE_T)stripe);
+  } else {
+    cerr << "DeviceModel: unknown device "<<name<<endl;
+    return 0;
+  }
+
+  if (!params.empty()) {
+    cerr << "DeviceModel: "<<name<<" has no parameter "<<(*params.begin()).first<<endl;
+    delete d;
+    return 0;
+  }
+  return d;
+}
+
+
+DiskModel::DiskModel(const string &s, const DiskGeometry &g) :
+  DeviceModel(s), geometry(g), last_track(0), last_head(0), last_sector(0), seektime(0), rotationtime(0)
+{
+}
+
+SIZE_T DiskModel::GetTrack(const SIZE_T block) const
+{
+  return block / (geometry.numheads*geometry.blockspertrack);
+}
+
+// A track is a cylinder: the heads all sit over it, and switching
+// between them costs nothing.  The sector is where the block is on the
+// platter, whichever head reads it.
+SIZE_T DiskModel::GetHead(const SIZE_T block) const
+{
+  return (block / geometry.blockspertrack) % geometry.numheads;
+}
+
+SIZE_T DiskModel::GetSector(const SIZE_T block) const
+{
+  return block % geometry.blockspertrack;
+}
+
+//
+// Note, this assumes disk is kept continously busy
+// or that time does not advance except during a disk op
+//
+double DiskModel::SeekTime(const SIZE_T fromtrack, const SIZE_T totrack) const
+{
+  SIZE_T trackhop = (SIZE_T) fabs((double)totrack-(double)fromtrack);
+  double trackhopfrac = (double)trackhop/(double)geometry.numtracks;
+
+  // This is a simplistic model.
+  double trackbytracktime = trackhop*geometry.trackseeklatency;
+  double longseektime = (trackhopfrac/(0.5))*geometry.averageseeklatency;
+  return trackbytracktime<longseektime ? trackbytracktime : longseektime;
+}
+
+double DiskModel::RotationTime(const SIZE_T fromsector, const SIZE_T tosector) const
+{
+  SIZE_T sectorhop = (tosector >= fromsector) ? (tosector-fromsector) : (geometry.blockspertrack - (fromsector - tosector));
+  double sectorhopfrac = (double)sectorhop/(double)geometry.blockspertrack;
+  return geometry.rotationallatency*sectorhopfrac;
+}
+
+double DiskModel::Access(const SIZE_T offblock, const SIZE_T numblock, const bool write)
+{
+
+  SIZE_T req_trackstart = GetTrack(offblock);
+  SIZE_T req_sectorstart= GetSector(offblock);
+
+  SIZE_T req_trackend = GetTrack(offblock+numblock-1);
+  SIZE_T req_sectorend= GetSector(offblock+numblock-1);
+
+  double timeinseek = SeekTime(last_track,req_trackstart);
+
+  // Now we are on the first track and we need to wait for the first
+  // sector to show up
+
+  double timeinrotation=RotationTime(last_sector,req_sectorstart);
+
+  // Now we've got to read numblockelements
+
+  // The number of side by side tracks we'll deal with:
+  SIZE_T numtrackbytrackhops = req_trackend-req_trackstart;
+  double timeintrackbytrackhops = numtrackbytrackhops*geometry.trackseeklatency;
+
+  // The total number of sectors read
+  double timeinreadsectors = geometry.rotationallatency*((double)numblock/(double)geometry.blockspertrack);
+
+  last_track=req_trackend;
+  last_head=GetHead(offblock+numblock-1);
+  last_sector=req_sectorend;
+
+  seektime+=timeinseek+timeintrackbytrackhops;
+  rotationtime+=timeinrotation;
+
+  return timeinseek+timeinrotation+timeintrackbytrackhops+timeinreadsectors;
+}
+
+SIZE_T DiskModel::GetHeadBlock() const
+{
+  return (last_track*geometry.numheads+last_head)*geometry.blockspertrack + last_sector;
+}
+
+double DiskModel::EstimatePositioning(const SIZE_T block) const
+{
+  return SeekTime(last_track,GetTrack(block)) + RotationTime(last_sector,GetSector(block));
+}
+
+ostream & DiskModel::Print(ostream &os) const
+{
+  os << "Disk(last_track="<<last_track
+     << ", last_head="<<last_head
+     << ", last_sector="<<last_sector
+     << ", seektime="<<seektime
+     << ", rotationtime="<<rotationtime<<")";
+  return os;
+}
+
+
+SSDModel::SSDModel(const string &s, const SIZE_T numblocks, const SIZE_T c,
+		   const double read, const double program, const double erase,
+		   const SIZE_T ppb, const double spare) :
+  DeviceModel(s), numpages(numblocks), channels(c), readlatency(read), programlatency(program),
+  eraselatency(erase), pagesperblock(ppb), mapped(0), active(NO_PAGE), writepoint(ppb), collecting(false),
+  hostwrites(0), programs(0), erases(0)
+{
+  // the spare asked for, but never less than collecting needs: all
+  // but the active erase block and the last free one must hold more
+  // pages than the host has, so one always has an invalid page.  On a
+  // small disk that can be more than spare.
+  SIZE_T minimum=numpages/pagesperblock+3;
+
+  numerase=(SIZE_T)ceil(numpages*(1+spare)/pagesperblock);
+  if (numerase<minimum) {
+    numerase=minimum;
+  }
+
+  l2p.assign(numpages,NO_PAGE);
+  p2l.assign(numerase*pagesperblock,NO_PAGE);
+  valid.assign(numerase,0);
+  isfree.assign(numerase,true);
+  for (SIZE_T b=0; b<numerase; b++) {
+    freeblocks.push_back(b);
+  }
+}
+
+double SSDModel::Parallel(const SIZE_T pages, const double latency) const
+{
+  return ((pages+channels-1)/channels)*latency;
+}
+
+void SSDModel::Invalidate(const SIZE_T page)
+{
+  SIZE_T p=l2p[page];
+
+  if (p!=NO_PAGE) {
+    p2l[p]=NO_PAGE;
+    valid[p/pagesperblock]--;
+    l2p[page]=NO_PAGE;
+    mapped--;
+  }
+}
+
+// Programs page at the write point, opening a new erase block when
+// the current one is full.  Returns the time spent collecting.
+double SSDModel::Append(const SIZE_T page)
+{
+  double t=0;
+
+  if (writepoint==pagesperblock) {
+    if (!collecting && freeblocks.size()<2) {
+      t=Collect();
+    }
+    active=freeblocks.front();
+    freeblocks.pop_front();
+    isfree[active]=false;
+    writepoint=0;
+  }
+
+  SIZE_T p=active*pagesperblock+writepoint++;
+
+  l2p[page]=p;
+  p2l[p]=page;
+  valid[active]++;
+  mapped++;
+  programs++;
+  return t;
+}
+
+// Greedy: the erase block with the fewest valid pages goes first
+double SSDModel::Collect()
+{
+  double t=0;
+
+  collecting=true;
+  while (freeblocks.size()<2) {
+    SIZE_T victim=NO_PAGE;
+    for (SIZE_T b=0; b<numerase; b++) {
+      if (!isfree[b] && b!=active && (victim==NO_PAGE || valid[b]<valid[victim])) {
+	victim=b;
+      }
+    }
+    if (victim==NO_PAGE || valid[victim]==pagesperblock) {
+      break;
+    }
+
+    SIZE_T moved=valid[victim];
+
+    for (SIZE_T p=victim*pagesperblock; p<(victim+1)*pagesperblock; p++) {
+      if (p2l[p]!=NO_PAGE) {
+	SIZE_T page=p2l[p];
+	Invalidate(page);
+	Append(page);
+      }
+    }
+    isfree[victim]=true;
+    freeblocks.push_back(victim);
+    erases++;
+    t+=Parallel(moved,readlatency+programlatency)+eraselatency;
+  }
+  collecting=false;
+  return t;
+}
+
+double SSDModel::Access(const SIZE_T block, const SIZE_T numblock, const bool write)
+{
+  if (!write) {
+    return Parallel(numblock,readlatency);
+  }
+
+  double t=Parallel(numblock,programlatency);
+
+  for (SIZE_T page=block; page<block+numblock; page++) {
+    hostwrites++;
+    Invalidate(page);
+    t+=Append(page);
+  }
+  return t;
+}
+
+void SSDModel::Occupy(const SIZE_T block, const SIZE_T numblock)
+{
+  for (SIZE_T page=block; page<block+numblock; page++) {
+    if (l2p[page]==NO_PAGE) {
+      Append(page);
+    }
+  }
+  // what it took to get here is not this run's
+  programs=0;
+  erases=0;
+}
+
+// A range bigger than what is mapped is looked for in the erase
+// blocks that hold valid pages instead, so discarding a whole disk
+// costs about what is on it
+void SSDModel::Discard(const SIZE_T block, const SIZE_T numblock)
+{
+  if (numblock<=mapped) {
+    for (SIZE_T page=block; page<block+numblock; page++) {
+      Invalidate(page);
+    }
+    return;
+  }
+  SIZE_T left=mapped;
+  for (SIZE_T b=0; b<numerase && left>0; b++) {
+    if (valid[b]==0) {
+      continue;
+    }
+    left-=valid[b];
+    for (SIZE_T p=b*pagesperblock; p<(b+1)*pagesperblock; p++) {
+      SIZE_T page=p2l[p];
+      if (page!=NO_PAGE && page>=block && page-block<numblock) {
+	Invalidate(page);
+      }
+    }
+  }
+}
+
+double SSDModel::GetWriteAmplification() const
+{
+  return hostwrites ? (double)programs/(double)hostwrites : 0;
+}
+
+ostream & SSDModel::Print(ostream &os) const
+{
+  os << "SSD(channels="<<channels
+     << ", read="<<readlatency
+     << ", program="<<programlatency
+     << ", erase="<<eraselatency
+     << ", pagesperblock="<<pagesperblock
+     << ", eraseblocks="<<numerase
+     << ", free="<<freeblocks.size()
+     << ", hostwrites="<<hostwrites
+     << ", programs="<<programs
+     << ", erases="<<erases
+     << ", writeamplification="<<GetWriteAmplification()<<")";
+  return os;
+}
+
+
+RAIDModel::RAIDModel(const string &s, const DiskGeometry &g, const SIZE_T l,
+		     const SIZE_T numdisks, const SIZE_T st) :
+  DeviceModel(s), level(l), stripe(st)
+{
+  SIZE_T datadisks = level==5 ? numdisks-1 : numdisks;
+  SIZE_T rows=((g.numblocks+stripe-1)/stripe+datadisks-1)/datadisks;
+  SIZE_T pertrack=g.numheads*g.blockspertrack;
+  DiskGeometry member(g);
+
+  member.numtracks=(rows*stripe+pertrack-1)/pertrack;
+  member.numblocks=member.numtracks*pertrack;
+  for (SIZE_T i=0; i<numdisks; i++) {
+    disks.push_back(new DiskModel("disk",member));
+  }
+}
+
+RAIDModel::~RAIDModel()
+{
+  for (vector<DiskModel *>::const_iterator i=disks.begin(); i!=disks.end(); ++i) {
+    delete *i;
+  }
+}
+
+void RAIDModel::Locate(const SIZE_T block, SIZE_T &disk, SIZE_T &diskblock) const
+{
+  SIZE_T s=block/stripe;
+  SIZE_T row=s/DataDisks();
+
+  disk=s%DataDisks();
+  if (level==5 && disk>=ParityDisk(row)) {
+    disk++;
+  }
+  diskblock=row*stripe+block%stripe;
+}
+
+// Grows disk's part of a request to cover num blocks from block on
+static void Extend(vector<SIZE_T> &first, vector<SIZE_T> &last,
+		   const SIZE_T disk, const SIZE_T block, const SIZE_T num)
+{
+  if (first[disk]==NO_PAGE) {
+    first[disk]=block;
+    last[disk]=block+num-1;
+  }
+  if (block<first[disk]) {
+    first[disk]=block;
+  }
+  if (block+num-1>last[disk]) {
+    last[disk]=block+num-1;
+  }
+}
+
+double RAIDModel::Access(const SIZE_T block, const SIZE_T numblock, const bool write)
+{
+  SIZE_T n=disks.size();
+  SIZE_T rowblocks=DataDisks()*stripe;
+  SIZE_T end=block+numblock;
+  vector<SIZE_T> first(n,NO_PAGE), last(n,0);     // each disk's part
+  vector<SIZE_T> rfirst(n,NO_PAGE), rlast(n,0);   // read first, to update parity
+
+  for (SIZE_T b=block; b<end; ) {
+    SIZE_T len=stripe-b%stripe;
+    SIZE_T disk, diskblock;
+
+    if (b+len>end) {
+      len=end-b;
+    }
+    Locate(b,disk,diskblock);
+    Extend(first,last,disk,diskblock,len);
+    if (level==5 && write) {
+      SIZE_T row=b/rowblocks;
+      SIZE_T parity=ParityDisk(row);
+      Extend(first,last,parity,diskblock,len);
+      if (row*rowblocks<block || (row+1)*rowblocks>end) {
+	// only part of the row, so its parity needs the old data
+	Extend(rfirst,rlast,disk,diskblock,len);
+	Extend(rfirst,rlast,parity,diskblock,len);
+      }
+    }
+    b+=len;
+  }
+
+  double slowest=0;
+
+  for (SIZE_T i=0; i<n; i++) {
+    double t=0;
+    if (rfirst[i]!=NO_PAGE) {
+      t+=disks[i]->Access(rfirst[i],rlast[i]-rfirst[i]+1,false);
+    }
+    if (first[i]!=NO_PAGE) {
+      t+=disks[i]->Access(first[i],last[i]-first[i]+1,write);
+    }
+    if (t>slowest) {
+      slowest=t;
+    }
+  }
+  return slowest;
+}
+
+double RAIDModel::EstimatePositioning(const SIZE_T block) const
+{
+  SIZE_T disk, diskblock;
+
+  Locate(block,disk,diskblock);
+  return disks[disk]->EstimatePositioning(diskblock);
+}
+
+double RAIDModel::GetSeekTime() const
+{
+  double t=0;
+
+  for (vector<DiskModel *>::const_iterator i=disks.begin(); i!=disks.end(); ++i) {
+    t+=(*i)->GetSeekTime();
+  }
+  return t;
+}
+
+double RAIDModel::GetRotationTime() const
+{
+  double t=0;
+
+  for (vector<DiskModel *>::const_iterator i=disks.begin(); i!=disks.end(); ++i) {
+    t+=(*i)->GetRotationTime();
+  }
+  return t;
+}
+
+ostream & RAIDModel::Print(ostream &os) const
+{
+  os << "RAID"<<level<<"(disks="<<disks.size()
+     << ", stripe="<<stripe;
+  for (vector<DiskModel *>::const_iterator i=disks.begin(); i!=disks.end(); ++i) {
+    os << ", "<<**i;
+  }
+  os << ")";
+  return os;
+}
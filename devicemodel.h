@@ -0,0 +1,202 @@
+#ifndef _devicemodel
+#define _devicemodel
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <deque>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// The shape of a disk as filestem.config gives it.  Every model gets
+// it; the rotating ones use all of it.
+//
+struct DiskGeometry {
+  SIZE_T numblocks;
+  SIZE_T numheads;
+  SIZE_T blockspertrack;
+  SIZE_T numtracks;
+  double averageseeklatency;
+  double trackseeklatency;
+  double rotationallatency;
+};
+
+
+//
+// How long a device takes to serve a request, for DiskSystem
+//
+// A model is chosen by a one line spec kept in filestem.config: a
+// name, then any number of name=value parameters, eg
+//
+//   disk                               the rotating disk, the default
+//   ssd channels=8 read=0.05 program=0.5 erase=3 pagesperblock=64 spare=0.07
+//   raid0 disks=4 stripe=16
+//   raid5 disks=5 stripe=16
+//   ram
+//
+// Parameters left out take the defaults above.  Times are in
+// milliseconds, like everything else in DiskSystem.
+//
+class DeviceModel {
+ protected:
+  string spec;
+ public:
+  DeviceModel(const string &s) : spec(s) {}
+  virtual ~DeviceModel() {}
+
+  // Milliseconds to serve numblock consecutive blocks from block on
+  virtual double Access(const SIZE_T block, const SIZE_T numblock, const bool write)=0;
+  // The blocks already hold data, eg, when an existing disk is opened
+  virtual void   Occupy(const SIZE_T block, const SIZE_T numblock) {}
+  // The blocks no longer hold anything the device must keep (TRIM)
+  virtual void   Discard(const SIZE_T block, const SIZE_T numblock) {}
+
+  // Time to get to block from where the device is now, without
+  // going there
+  virtual double EstimatePositioning(const SIZE_T block) const { return 0; }
+  // Where the last request ended, for sweeps; 0 if it does not matter
+  virtual SIZE_T GetHeadBlock() const { return 0; }
+  // Time spent seeking and waiting for rotation in all requests
+  virtual double GetSeekTime() const { return 0; }
+  virtual double GetRotationTime() const { return 0; }
+
+  const string &GetSpec() const { return spec; }
+  virtual ostream & Print(ostream &os) const=0;
+
+  // 0, with a complaint on cerr, unless spec names a known model
+  // with parameters that make sense for g
+  static DeviceModel *Create(const string &spec, const DiskGeometry &g);
+};
+
+inline ostream & operator<<(ostream &os, const DeviceModel &d) { return d.Print(os); }
+
+
+//
+// Heads, tracks and a spinning platter, circa 1979
+//
+class DiskModel : public DeviceModel {
+ private:
+  DiskGeometry geometry;
+  SIZE_T last_track;
+  SIZE_T last_head;
+  SIZE_T last_sector;
+  double seektime;
+  double rotationtime;
+
+  SIZE_T GetTrack(const SIZE_T block) const;
+  SIZE_T GetHead(const SIZE_T block) const;
+  SIZE_T GetSector(const SIZE_T block) const;
+  double SeekTime(const SIZE_T fromtrack, const SIZE_T totrack) const;
+  double RotationTime(const SIZE_T fromsector, const SIZE_T tosector) const;
+ public:
+  DiskModel(const string &spec, const DiskGeometry &g);
+
+  double Access(const SIZE_T block, const SIZE_T numblock, const bool write);
+  double EstimatePositioning(const SIZE_T block) const;
+  SIZE_T GetHeadBlock() const;
+  double GetSeekTime() const { return seektime; }
+  double GetRotationTime() const { return rotationtime; }
+  ostream & Print(ostream &os) const;
+};
+
+
+//
+// Flash behind a page mapped FTL
+//
+// A block is a flash page.  Reads and programs of the pages of a
+// request go to channels in parallel.  Writes are appended at the
+// write point, so an overwrite leaves the old page invalid, and when
+// only one erase block is free the one with the fewest valid pages is
+// collected: its valid pages are copied to the write point and it is
+// erased, in the time of the write that needed the room.  The spare
+// fraction of flash the host never sees is what keeps that cheap.
+// Write amplification is pages programmed per page written.
+//
+class SSDModel : public DeviceModel {
+ private:
+  SIZE_T numpages;        // as the host sees them
+  SIZE_T channels;
+  double readlatency;
+  double programlatency;
+  double eraselatency;
+  SIZE_T pagesperblock;
+  SIZE_T numerase;        // erase blocks, spare included
+
+  vector<SIZE_T> l2p;     // NO_PAGE if never written or discarded
+  vector<SIZE_T> p2l;
+  vector<SIZE_T> valid;   // per erase block
+  vector<bool>   isfree;
+  SIZE_T         mapped;  // pages with an l2p entry
+  deque<SIZE_T>  freeblocks;
+  SIZE_T active;          // erase block at the write point
+  SIZE_T writepoint;      // next page in it
+  bool   collecting;
+
+  SIZE_T hostwrites, programs, erases;
+
+  void   Invalidate(const SIZE_T page);
+  double Append(const SIZE_T page);
+  double Collect();
+  double Parallel(const SIZE_T pages, const double latency) const;
+ public:
+  SSDModel(const string &spec, const SIZE_T numblocks, const SIZE_T channels,
+	   const double read, const double program, const double erase,
+	   const SIZE_T pagesperblock, const double spare);
+
+  double Access(const SIZE_T block, const SIZE_T numblock, const bool write);
+  void   Occupy(const SIZE_T block, const SIZE_T numblock);
+  void   Discard(const SIZE_T block, const SIZE_T numblock);
+  double GetWriteAmplification() const;
+  ostream & Print(ostream &os) const;
+};
+
+
+//
+// Striping over rotating disks shaped like the configured one
+//
+// Blocks go to the disks stripe blocks at a time.  With RAID-5 each
+// row of stripes has one parity stripe, on a different disk for each
+// row, and a write that covers only part of a row reads the old data
+// and parity before it writes the new.  The disks work in parallel,
+// and a request takes as long as the slowest of them.  Each disk
+// serves its part of a request as one access, from its first block
+// to its last.
+//
+class RAIDModel : public DeviceModel {
+ private:
+  SIZE_T level;           // 0 or 5
+  SIZE_T stripe;          // blocks
+  vector<DiskModel *> disks;
+
+  SIZE_T DataDisks() const { return level==5 ? disks.size()-1 : disks.size(); }
+  SIZE_T ParityDisk(const SIZE_T row) const { return disks.size()-1-row%disks.size(); }
+  // Where a block lives: its disk and block on that disk
+  void   Locate(const SIZE_T block, SIZE_T &disk, SIZE_T &diskblock) const;
+ public:
+  RAIDModel(const string &spec, const DiskGeometry &g, const SIZE_T level,
+	    const SIZE_T numdisks, const SIZE_T stripe);
+  ~RAIDModel();
+
+  double Access(const SIZE_T block, const SIZE_T numblock, const bool write);
+  double EstimatePositioning(const SIZE_T block) const;
+  double GetSeekTime() const;
+  double GetRotationTime() const;
+  ostream & Print(ostream &os) const;
+};
+
+
+//
+// Memory: nothing takes any time
+//
+class RAMModel : public DeviceModel {
+ public:
+  RAMModel(const string &spec) : DeviceModel(spec) {}
+
+  double Access(const SIZE_T block, const SIZE_T numblock, const bool write) { return 0; }
+  ostream & Print(ostream &os) const { return os << "RAM()"; }
+};
+
+#endif
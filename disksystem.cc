@@ -1,6 +1,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -10,64 +17,22 @@
 #include "disksystem.h"
 
 
-static SIZE_T mywrite(FILE *f, const SIZE_T off, const BYTE_T *buf, const int len)
+static SIZE_T mypread(const int fd, const off_t off, BYTE_T *buf, const SIZE_T len)
 {
-  SIZE_T left=len;
-  SIZE_T sent;
+  struct iovec iov;
 
-  fseek(f,off,SEEK_SET);
-  while (left>0) {
-    sent=fwrite(&(buf[len-left]),1,left,f);
-    if (sent<0) {	
-      return 0;
-    } else if (sent==0) {
-      break;
-    } else {
-      left-=sent;
-    }
-  }
-  return len-left;
+  iov.iov_base=buf;
+  iov.iov_len=len;
+  return PreadvAll(fd,off,&iov,1);
 }
 
-static SIZE_T myread(FILE *f, const SIZE_T off, BYTE_T *buf, const int len, bool trunconeof=true)
+static SIZE_T mypwrite(const int fd, const off_t off, const BYTE_T *buf, const SIZE_T len)
 {
-  SIZE_T left=len;
-  SIZE_T sent;
+  struct iovec iov;
 
-  fseek(f,off,SEEK_SET);
-  while (left>0) {
-    sent=fread(&(buf[len-left]),1,left,f);
-    if (sent<0) {	
-      return 0;
-    } else if (sent==0) {
-      // if we reached this point, the likely cause is that we
-      // are trying to read a block which has not been allocated yet
-      // Hence, we will try to ftruncate to this size and then retry the
-      // read.  However, we don't want to loop forever doing this,
-      // hence the trunconeof parameter
-      if (!feof(f)) { 
-	// OK, the end of file is not the problem
-	break;
-      } else {
-	// EOF case... should we truncate and try again?
-	if (!trunconeof) { 
-	  break;
-	} else {
-	  // yes!
-	  if (ftruncate(fileno(f),off+len)) { 
-	    // uh oh, something weird is going on
-	    break;
-	  } else {
-	    // OK, now retry, but don't truncate a second time
-	    return myread(f,off,buf,len,false);
-	  }
-	}
-      }
-    } else {
-      left-=sent;
-    }
-  }
-  return len-left;
+  iov.iov_base=(BYTE_T *)buf;
+  iov.iov_len=len;
+  return PwritevAll(fd,off,&iov,1);
 }
 
 
@@ -81,11 +46,19 @@ DiskSystem::DiskSystem(const string &filestem,
 		       const SIZE_T tracks,
 		       const double avgseek,
 		       const double trackseek,
-		       const double rotlat) :
-  bitmap(0),
-  datafilefd(0),
+		       const double rotlat,
+		       const string &devicespec) :
+  numallocated(0),
+  freehint(0),
+  datafilefd(-1),
   configfilefd(0),
-  bitmapfilefd(0),
+  bitmapfilefd(-1),
+  map(0),
+  mapbytes(0),
+  mapskew(0),
+  async(0),
+  direct(false),
+  dioalign(1),
   diskfilestem(filestem), 
   offset(offset),
   numblocks(blcks),
@@ -93,11 +66,14 @@ DiskSystem::DiskSystem(const string &filestem,
   numheads(heads),
   blockspertrack(blckspertrack),
   numtracks(tracks),
-  last_track(0),
-  last_sector(0),
   averageseeklatency(avgseek),
   trackseeklatency(trackseek),
-  rotationallatency(rotlat)
+  rotationallatency(rotlat),
+  devicespec(devicespec),
+  device(0),
+  queuedepth(0),
+  busyuntil(0),
+  queuetrace(0)
 {
   if (create) { 
     // Only in this case are the parameters used:
@@ -111,10 +87,12 @@ DiskSystem::~DiskSystem()
 {
   WriteConfig();
   WriteBitMap();
-  fclose(configfilefd);
-  fclose(bitmapfilefd);
-  fclose(datafilefd);
-  delete [] bitmap;
+  SetAsync(0);
+  SetMapped(false);
+  if (configfilefd) { fclose(configfilefd); }
+  if (bitmapfilefd>=0) { close(bitmapfilefd); }
+  if (datafilefd>=0) { close(datafilefd); }
+  delete device;
 }
 
 ERROR_T DiskSystem::SanityCheckConfig()
@@ -140,23 +118,25 @@ ERROR_T DiskSystem::WriteConfig()
   fprintf(configfilefd,"# filestem\n");
   fprintf(configfilefd,"%s\n",diskfilestem.c_str());
   fprintf(configfilefd,"# offset\n");
-  fprintf(configfilefd,"%u\n",offset);
+  fprintf(configfilefd,"%" PRI_SIZE_T "\n",offset);
   fprintf(configfilefd,"# numblocks\n");
-  fprintf(configfilefd,"%u\n",numblocks);
+  fprintf(configfilefd,"%" PRI_SIZE_T "\n",numblocks);
   fprintf(configfilefd,"# blocksize\n");
-  fprintf(configfilefd,"%u\n",blocksize);
+  fprintf(configfilefd,"%" PRI_SIZE_T "\n",blocksize);
   fprintf(configfilefd,"# numheads\n");
-  fprintf(configfilefd,"%u\n",numheads);
+  fprintf(configfilefd,"%" PRI_SIZE_T "\n",numheads);
   fprintf(configfilefd,"# blockspertrack\n");
-  fprintf(configfilefd,"%u\n",blockspertrack);
+  fprintf(configfilefd,"%" PRI_SIZE_T "\n",blockspertrack);
   fprintf(configfilefd,"# numtracks\n");
-  fprintf(configfilefd,"%u\n",numtracks);
+  fprintf(configfilefd,"%" PRI_SIZE_T "\n",numtracks);
   fprintf(configfilefd,"# averageseeklatency\n");
   fprintf(configfilefd,"%lf\n",averageseeklatency);
   fprintf(configfilefd,"# trackseeklatency\n");
   fprintf(configfilefd,"%lf\n",trackseeklatency);
   fprintf(configfilefd,"# rotationalatency\n");
   fprintf(configfilefd,"%lf\n",rotationallatency);
+  fprintf(configfilefd,"# device\n");
+  fprintf(configfilefd,"%s\n",devicespec.c_str());
   fflush(configfilefd);
 
   return ERROR_NOERROR;
@@ -166,10 +146,10 @@ ERROR_T DiskSystem::WriteConfig()
 
 ERROR_T DiskSystem::ReadConfig()
 {
-  char buf[80];
+  char buf[256];
 
-#define GETNEXTVAL do { fgets(buf,80,configfilefd); } while (buf[0]=='#')  
-#define PARSEUNSIGNED(x) do { sscanf(buf,"%u",x); } while (0)
+#define GETNEXTVAL do { fgets(buf,sizeof(buf),configfilefd); } while (buf[0]=='#')  
+#define PARSEUNSIGNED(x) do { sscanf(buf,"%" SCN_SIZE_T,x); } while (0)
 #define PARSEDOUBLE(x) do { sscanf(buf,"%lf",x); } while (0)
 
   rewind(configfilefd);
@@ -196,37 +176,97 @@ ERROR_T DiskSystem::ReadConfig()
   PARSEDOUBLE(&trackseeklatency);
   GETNEXTVAL;
   PARSEDOUBLE(&rotationallatency);
+  // older files end here, and are rotating disks
+  devicespec="disk";
+  while (fgets(buf,sizeof(buf),configfilefd)) {
+    if (buf[0]!='#') {
+      buf[strcspn(buf,"\n")]=0;
+      devicespec=buf;
+      break;
+    }
+  }
 
   return ERROR_NOERROR;
 }
 
 
+// The file has 8 blocks a byte, the first in the high bit, so a
+// word is its 8 bytes in order, each with its bits reversed
+static uint64_t ReverseBitsInBytes(uint64_t w)
+{
+  w=((w>>1)&0x5555555555555555ULL) | ((w&0x5555555555555555ULL)<<1);
+  w=((w>>2)&0x3333333333333333ULL) | ((w&0x3333333333333333ULL)<<2);
+  w=((w>>4)&0x0f0f0f0f0f0f0f0fULL) | ((w&0x0f0f0f0f0f0f0f0fULL)<<4);
+  return w;
+}
+
+// words read or written with one system call
+#define BITMAP_CHUNK_WORDS 8192
+
 ERROR_T DiskSystem::WriteBitMap()
 {
-  rewind(bitmapfilefd);
-  
   SIZE_T numbitmapbytes = numblocks / 8 + (numblocks%8 != 0); 
+  vector<BYTE_T> buf;
 
-  if (mywrite(bitmapfilefd,0,bitmap,numbitmapbytes)!=numbitmapbytes) { 
-    cerr << "Can't write bitmap file\n";
-    return ERROR_IMPLBUG;
+  for (SIZE_T d=0; d<dirtywords.size(); d++) {
+    while (dirtywords[d]) {
+      // a run of dirty words goes out in one write
+      SIZE_T first=64*d+__builtin_ctzll(dirtywords[d]);
+      SIZE_T last=first;
+
+      while (last+1<bitmap.size() && last+1-first<BITMAP_CHUNK_WORDS
+	     && ((dirtywords[(last+1)/64]>>((last+1)%64)) & 1)) {
+	last++;
+      }
+
+      SIZE_T end = 8*(last+1)<numbitmapbytes ? 8*(last+1) : numbitmapbytes;
+      SIZE_T n=end-8*first;
+
+      buf.resize(n);
+      for (SIZE_T i=0; i<n; i++) {
+	buf[i]=ReverseBitsInBytes(bitmap[first+i/8])>>(8*(i%8));
+      }
+      if (mypwrite(bitmapfilefd,(off_t)8*first,&buf[0],n)!=n) { 
+	cerr << "Can't write bitmap file\n";
+	return ERROR_IMPLBUG;
+      }
+      for (SIZE_T w=first; w<=last; w++) {
+	dirtywords[w/64] &= ~(1ULL<<(w%64));
+      }
+    }
   }
   return ERROR_NOERROR;
 }
 
 ERROR_T DiskSystem::ReadBitMap()
 {
-  rewind(bitmapfilefd);
-  
   SIZE_T numbitmapbytes = numblocks / 8 + (numblocks%8 != 0); 
+  SIZE_T numwords = numblocks/64 + (numblocks%64 != 0);
+  vector<BYTE_T> buf(8*BITMAP_CHUNK_WORDS);
 
-  if (bitmap) { delete [] bitmap; } ;
+  bitmap.assign(numwords,0);
+  fullwords.assign(numwords/64 + (numwords%64 != 0),0);
+  dirtywords.assign(fullwords.size(),0);
+  numallocated=0;
+  freehint=0;
 
-  bitmap = new BYTE_T [numbitmapbytes];
+  for (SIZE_T w=0; w<numwords; w+=BITMAP_CHUNK_WORDS) {
+    SIZE_T n = numbitmapbytes-8*w<buf.size() ? numbitmapbytes-8*w : buf.size();
 
-  if (myread(bitmapfilefd,0,bitmap,numbitmapbytes,false)!=numbitmapbytes) { 
-    cerr << "Can't read bitmap file\n";
-    return ERROR_IMPLBUG;
+    if (mypread(bitmapfilefd,(off_t)8*w,&buf[0],n)!=n) { 
+      cerr << "Can't read bitmap file\n";
+      return ERROR_IMPLBUG;
+    }
+    for (SIZE_T i=0; i<n; i++) {
+      bitmap[w+i/8] |= (uint64_t)buf[i]<<(8*(i%8));
+    }
+  }
+  for (SIZE_T w=0; w<numwords; w++) {
+    bitmap[w]=ReverseBitsInBytes(bitmap[w]) & ValidBits(w);
+    numallocated+=__builtin_popcountll(bitmap[w]);
+    if (bitmap[w]==ValidBits(w)) {
+      fullwords[w/64] |= 1ULL<<(w%64);
+    }
   }
   return ERROR_NOERROR;
 }
@@ -257,16 +297,22 @@ ERROR_T DiskSystem::InitFromConfigFile()
     return rc;
   }
 
-  if (datafilefd) { fclose(datafilefd);}
+  rc=CreateDevice();
 
-  if ((datafilefd = fopen(dataname.c_str(),"r+"))==0) { 
+  if (rc) { 
+    return rc;
+  }
+
+  if (datafilefd>=0) { close(datafilefd);}
+
+  if ((datafilefd = open(dataname.c_str(),O_RDWR))<0) { 
     return ERROR_NOFILE;
   }
 
 
-  if (bitmapfilefd) { fclose(bitmapfilefd);}
+  if (bitmapfilefd>=0) { close(bitmapfilefd);}
 
-  if ((bitmapfilefd = fopen(bitmapname.c_str(),"r+"))==0) { 
+  if ((bitmapfilefd = open(bitmapname.c_str(),O_RDWR))<0) { 
     return ERROR_NOFILE;
   }
   
@@ -276,6 +322,39 @@ ERROR_T DiskSystem::InitFromConfigFile()
     return rc;
   }
 
+  // whatever is allocated was written in some earlier run; the device
+  // is told one run of allocated blocks at a time
+  SIZE_T first=0;
+  SIZE_T len=0;
+
+  for (SIZE_T w=0; w<bitmap.size(); w++) {
+    uint64_t bits=bitmap[w];
+
+    if (len>0 && !(bits&1)) {
+      device->Occupy(first,len);
+      len=0;
+    }
+    while (bits) {
+      SIZE_T b=__builtin_ctzll(bits);
+      uint64_t clear=~(bits>>b);
+      SIZE_T n = clear ? __builtin_ctzll(clear) : 64-b;
+
+      if (len==0) {
+	first=64*(uint64_t)w+b;
+      }
+      len+=n;
+      if (b+n==64) {
+	break;   // the run may go on in the next word
+      }
+      device->Occupy(first,len);
+      len=0;
+      bits&=~0ULL<<(b+n);
+    }
+  }
+  if (len>0) {
+    device->Occupy(first,len);
+  }
+
   return ERROR_NOERROR;
 }
 
@@ -292,6 +371,12 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
     return rc;
   }
 
+  rc=CreateDevice();
+
+  if (rc) { 
+    return rc;
+  }
+
   // it should be the case that none of the files exist
   // except for the data file, since we may be using a chunk of it
   // ie, think parition.
@@ -322,19 +407,24 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
   }
 
 
-  // allocate in-memory bitmap
+  // allocate in-memory bitmap, all of it to be written
 
-  SIZE_T numbitmapbytes = numblocks / 8 + (numblocks%8 != 0); 
-  
-  bitmap = new BYTE_T [numbitmapbytes];
+  SIZE_T numwords = numblocks/64 + (numblocks%64 != 0);
 
-  memset(bitmap,0,numbitmapbytes);
+  bitmap.assign(numwords,0);
+  fullwords.assign(numwords/64 + (numwords%64 != 0),0);
+  dirtywords.assign(fullwords.size(),~0ULL);
+  if (numwords%64) {
+    dirtywords.back()=(1ULL<<(numwords%64))-1;
+  }
+  numallocated=0;
+  freehint=0;
 
   // create the bitmap file and write out the bitmap
 
-  if (bitmapfilefd) { fclose(bitmapfilefd); }
+  if (bitmapfilefd>=0) { close(bitmapfilefd); }
 
-  if ((bitmapfilefd = fopen(bitmapname.c_str(),"w+"))==0) { 
+  if ((bitmapfilefd = open(bitmapname.c_str(),O_RDWR|O_CREAT|O_TRUNC,0666))<0) { 
     return ERROR_NOFILE;
   }
 
@@ -348,20 +438,35 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
   // notice that we will REUSE an existing data file if it exists
   // The idea is that we will write only from offset to offset+blocksize*numblocks
 
-  if (datafilefd) { fclose(datafilefd);}
+  if (datafilefd>=0) { close(datafilefd);}
 
-  if (stat(dataname.c_str(),&s)!=-1) { 
-    // reuse existing datafile
-    if ((datafilefd = fopen(dataname.c_str(),"r+"))==0) { 
-      return ERROR_NOFILE;
-    }
-  } else {
-    // create new data file
-    if ((datafilefd = fopen(dataname.c_str(),"w+"))==0) { 
+  if ((datafilefd = open(dataname.c_str(),O_RDWR|O_CREAT,0666))<0) { 
+    return ERROR_NOFILE;
+  }
+
+  return Preallocate();
+}
+
+// Reserve the disk's part of the data file now, so writes later on
+// never have to grow it.  Only the range is touched, so an existing
+// file around it (a partition) is left alone.  A file system that
+// cannot preallocate just gets a file of the right length.
+ERROR_T DiskSystem::Preallocate()
+{
+  off_t len=(off_t)offset+(off_t)numblocks*blocksize;
+  int rc=fallocate(datafilefd,0,offset,(off_t)numblocks*blocksize);
+
+  if (rc!=0 && (errno==EOPNOTSUPP || errno==ENOSYS)) {
+    struct stat s;
+    if (fstat(datafilefd,&s)!=0) {
       return ERROR_NOFILE;
     }
+    rc = s.st_size<len ? ftruncate(datafilefd,len) : 0;
+  }
+  if (rc!=0) {
+    cerr << "DiskSystem: can't make room for "<<numblocks<<" blocks in the data file\n";
+    return ERROR_NOSPACE;
   }
-
   return ERROR_NOERROR;
 }
 
@@ -369,49 +474,154 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
 
     
 
-//
-// Note, this assumes disk is kept continously busy
-// or that time does not advance except during a disk op
-//
-double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock) 
+ERROR_T DiskSystem::CreateDevice()
 {
+  DiskGeometry g;
+
+  g.numblocks=numblocks;
+  g.numheads=numheads;
+  g.blockspertrack=blockspertrack;
+  g.numtracks=numtracks;
+  g.averageseeklatency=averageseeklatency;
+  g.trackseeklatency=trackseeklatency;
+  g.rotationallatency=rotationallatency;
+
+  delete device;
+  if (!(device=DeviceModel::Create(devicespec,g))) {
+    return ERROR_BADCONFIG;
+  }
+  return ERROR_NOERROR;
+}
 
-  SIZE_T req_trackstart = (offblock) / (numheads*blockspertrack);
-  SIZE_T req_sectorstart=  (offblock) % (numheads*blockspertrack);
+double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock, const bool write)
+{
+  return device ? device->Access(offblock,numblock,write) : 0;
+}
 
-  SIZE_T req_trackend = (offblock+numblock-1) / (numheads*blockspertrack);
-  SIZE_T req_sectorend=  (offblock+numblock-1) % (numheads*blockspertrack);
+SIZE_T DiskSystem::GetTrack(const SIZE_T block) const
+{
+  return block / (numheads*blockspertrack);
+}
 
-  SIZE_T trackhop = (SIZE_T) fabs((double)req_trackstart-(double)last_track);
-  double trackhopfrac = (double)trackhop/(double)numtracks;
+SIZE_T DiskSystem::GetHeadBlock() const
+{
+  return device ? device->GetHeadBlock() : 0;
+}
 
-  // This is a simplistic model.  
-  double trackbytracktime = trackhop*trackseeklatency;
-  double longseektime = (trackhopfrac/(0.5))*averageseeklatency;
-  double timeinseek = trackbytracktime<longseektime ? trackbytracktime : longseektime;
+double DiskSystem::EstimatePositioning(const SIZE_T block) const
+{
+  return device ? device->EstimatePositioning(block) : 0;
+}
 
-  // Now we are on the first track and we need to wait for the first
-  // sector to show up
+double DiskSystem::GetSeekTime() const
+{
+  return device ? device->GetSeekTime() : 0;
+}
 
-  SIZE_T sectorhop = (req_sectorstart >= last_sector) ? (req_sectorstart-last_sector) : (blockspertrack - (last_sector - req_sectorstart));
-  double sectorhopfrac = (double)sectorhop/(double)blockspertrack;
-  double timeinrotation=rotationallatency*sectorhopfrac;
+double DiskSystem::GetRotationTime() const
+{
+  return device ? device->GetRotationTime() : 0;
+}
+
+
+bool DiskSystem::Misaligned(const vector<struct iovec> &iov) const
+{
+  if (!direct) {
+    return false;
+  }
+  for (vector<struct iovec>::const_iterator i=iov.begin(); i!=iov.end(); ++i) {
+    if ((uintptr_t)(*i).iov_base%dioalign) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  // Now we've got to read numblockelements
+// O_DIRECT takes only aligned buffers, so anything else is moved
+// through an aligned copy
+BYTE_T *DiskSystem::Bounce(const vector<struct iovec> &iov, vector<struct iovec> &bounced) const
+{
+  void *p;
 
-  // The number of side by side tracks we'll deal with:
-  SIZE_T numtrackbytrackhops = req_trackend-req_trackstart;
-  double timeintrackbytrackhops = numtrackbytrackhops*trackseeklatency;
+  if (posix_memalign(&p,dioalign,iov.size()*blocksize)) {
+    return 0;
+  }
+  bounced=iov;
+  for (SIZE_T i=0;i<iov.size();i++) {
+    bounced[i].iov_base=(BYTE_T *)p+i*blocksize;
+  }
+  return (BYTE_T *)p;
+}
 
-  // The total number of sectors read
-  double timeinreadsectors = rotationallatency*((double)numblock/(double)blockspertrack);
+// Blocks past the end of the data file have never been written,
+// and read as zeros
+ERROR_T DiskSystem::ReadData(const SIZE_T inoffblock, vector<struct iovec> &iov)
+{
+  if (map) {
+    for (SIZE_T i=0;i<iov.size();i++) {
+      memcpy(iov[i].iov_base,BlockAddress(inoffblock+i),blocksize);
+    }
+    return ERROR_NOERROR;
+  }
+  if (Misaligned(iov)) {
+    vector<struct iovec> bounced;
+    BYTE_T *buf=Bounce(iov,bounced);
+    if (!buf) {
+      return ERROR_NOMEM;
+    }
+    int rc=ReadData(inoffblock,bounced);
+    for (SIZE_T i=0;i<iov.size();i++) {
+      memcpy(iov[i].iov_base,bounced[i].iov_base,blocksize);
+    }
+    free(buf);
+    return rc;
+  }
 
-  last_track=req_trackend;
-  last_sector=req_sectorend;
+  SIZE_T want=iov.size()*blocksize;
+  vector<struct iovec> left(iov);
+  SIZE_T got=PreadvAll(datafilefd,(off_t)offset+(off_t)inoffblock*blocksize,&left[0],left.size());
 
-  return timeinseek+timeinrotation+timeintrackbytrackhops+timeinreadsectors;
+  if (got<want) {
+    struct stat s;
+    if (fstat(datafilefd,&s)!=0 || (off_t)(offset+inoffblock*blocksize+got)<s.st_size) {
+      cerr << "DiskSystem::Read: pread has failed"<<endl;
+      return ERROR_IMPLBUG;
+    }
+    ZeroFrom(iov,got);
+  }
+  return ERROR_NOERROR;
 }
 
+ERROR_T DiskSystem::WriteData(const SIZE_T inoffblock, vector<struct iovec> &iov)
+{
+  if (map) {
+    for (SIZE_T i=0;i<iov.size();i++) {
+      memcpy(BlockAddress(inoffblock+i),iov[i].iov_base,blocksize);
+    }
+    return ERROR_NOERROR;
+  }
+  if (Misaligned(iov)) {
+    vector<struct iovec> bounced;
+    BYTE_T *buf=Bounce(iov,bounced);
+    if (!buf) {
+      return ERROR_NOMEM;
+    }
+    for (SIZE_T i=0;i<iov.size();i++) {
+      memcpy(bounced[i].iov_base,iov[i].iov_base,blocksize);
+    }
+    int rc=WriteData(inoffblock,bounced);
+    free(buf);
+    return rc;
+  }
+
+  SIZE_T want=iov.size()*blocksize;
+
+  if (PwritevAll(datafilefd,(off_t)offset+(off_t)inoffblock*blocksize,&iov[0],iov.size())!=want) {
+    cerr << "DiskSystem::Write: pwrite has failed"<<endl;
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
 
 ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
 			 const SIZE_T   numblock,
@@ -425,23 +635,30 @@ ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
     return ERROR_NOSPACE;
   }
 
-  reqtime=ModelAccess(inoffblock,numblock);
+  reqtime=ModelAccess(inoffblock,numblock,false);
+
+  SIZE_T first=blocks.size();
+  vector<struct iovec> iov(numblock);
 
   for (SIZE_T i=0;i<numblock;i++) { 
-    Block b(blocksize);
     if (!IsBlockAllocated(inoffblock+i)) { 
       if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
 	cerr <<"DiskSystem::Read: reading unallocated block "<<(i+inoffblock)<<endl;
       }
     }
-    if (myread(datafilefd,offset+(inoffblock+i)*blocksize,b.data,blocksize,true)!=blocksize) { 
-      cerr << "DiskSystem::Read: myread has failed"<<endl;
-      return ERROR_IMPLBUG;
-    }
-    blocks.push_back(b);
+    blocks.push_back(Block(blocksize));
+  }
+  for (SIZE_T i=0;i<numblock;i++) { 
+    iov[i].iov_base=blocks[first+i].data;
+    iov[i].iov_len=blocksize;
   }
 
-  return ERROR_NOERROR;
+  ERROR_T rc=ReadData(inoffblock,iov);
+
+  if (rc!=ERROR_NOERROR) {
+    blocks.resize(first);
+  }
+  return rc;
 }
 
 ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
@@ -456,7 +673,9 @@ ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
     return ERROR_NOSPACE;
   }
 
-  reqtime=ModelAccess(inoffblock,numblock);
+  reqtime=ModelAccess(inoffblock,numblock,true);
+
+  vector<struct iovec> iov(numblock);
 
   for (SIZE_T i=0;i<numblock;i++) { 
     if (!IsBlockAllocated(inoffblock+i)) { 
@@ -464,13 +683,11 @@ ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
 	cerr <<"DiskSystem::Write: writing unallocated block "<<(i+inoffblock)<<endl;
       }
     }
-    if (mywrite(datafilefd,offset+(inoffblock+i)*blocksize,blocks[i].data,blocksize)!=blocksize) {  
-      cerr << "DiskSystem::Write: mywrite has failed"<<endl;
-      return ERROR_IMPLBUG;
-    }
+    iov[i].iov_base=(BYTE_T *)blocks[i].data;
+    iov[i].iov_len=blocksize;
   }
 
-  return ERROR_NOERROR;
+  return WriteData(inoffblock,iov);
 }
 
 
@@ -505,6 +722,525 @@ ERROR_T DiskSystem::Write(const SIZE_T inoffblock, const Block &blocks, double &
 }
 
 
+ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
+			 const SIZE_T   numblock,
+			 BYTE_T        *buf,
+			 double        &reqtime)
+{
+  reqtime=0;
+
+  if (inoffblock+numblock > numblocks) { 
+    cerr << "DiskSystem::Read: Attempt to read blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+
+  reqtime=ModelAccess(inoffblock,numblock,false);
+
+  vector<struct iovec> iov(numblock);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    if (!IsBlockAllocated(inoffblock+i)) { 
+      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+	cerr <<"DiskSystem::Read: reading unallocated block "<<(i+inoffblock)<<endl;
+      }
+    }
+    iov[i].iov_base=buf+i*blocksize;
+    iov[i].iov_len=blocksize;
+  }
+
+  return ReadData(inoffblock,iov);
+}
+
+ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
+			  const SIZE_T   numblock,
+			  const BYTE_T  *buf,
+			  double        &reqtime)
+{
+  reqtime=0;
+
+  if (inoffblock+numblock > numblocks) { 
+    cerr << "DiskSystem::Write: Attempt to write blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+
+  reqtime=ModelAccess(inoffblock,numblock,true);
+
+  vector<struct iovec> iov(numblock);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    if (!IsBlockAllocated(inoffblock+i)) { 
+      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+	cerr <<"DiskSystem::Write: writing unallocated block "<<(i+inoffblock)<<endl;
+      }
+    }
+    iov[i].iov_base=(BYTE_T *)buf+i*blocksize;
+    iov[i].iov_len=blocksize;
+  }
+
+  return WriteData(inoffblock,iov);
+}
+
+
+ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
+			  const vector<const BYTE_T *> &bufs,
+			  double        &reqtime)
+{
+  SIZE_T numblock=bufs.size();
+
+  reqtime=0;
+
+  if (inoffblock+numblock > numblocks) { 
+    cerr << "DiskSystem::Write: Attempt to write blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+
+  reqtime=ModelAccess(inoffblock,numblock,true);
+
+  vector<struct iovec> iov(numblock);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    if (!IsBlockAllocated(inoffblock+i)) { 
+      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+	cerr <<"DiskSystem::Write: writing unallocated block "<<(i+inoffblock)<<endl;
+      }
+    }
+    iov[i].iov_base=(BYTE_T *)bufs[i];
+    iov[i].iov_len=blocksize;
+  }
+
+  return WriteData(inoffblock,iov);
+}
+
+ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
+			 const vector<BYTE_T *> &bufs,
+			 double        &reqtime)
+{
+  SIZE_T numblock=bufs.size();
+
+  reqtime=0;
+
+  if (inoffblock+numblock > numblocks) { 
+    cerr << "DiskSystem::Read: Attempt to read blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+
+  reqtime=ModelAccess(inoffblock,numblock,false);
+
+  vector<struct iovec> iov(numblock);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    if (!IsBlockAllocated(inoffblock+i)) { 
+      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+	cerr <<"DiskSystem::Read: reading unallocated block "<<(i+inoffblock)<<endl;
+      }
+    }
+    iov[i].iov_base=bufs[i];
+    iov[i].iov_len=blocksize;
+  }
+
+  return ReadData(inoffblock,iov);
+}
+
+ERROR_T DiskSystem::SetAsync(const SIZE_T depth, const bool forcethreads)
+{
+  delete async;
+  async=0;
+  if (depth>0 && !(async=AsyncIO::Create(datafilefd,depth,forcethreads))) {
+    return ERROR_NOMEM;
+  }
+  return ERROR_NOERROR;
+}
+
+// The request is charged now, like any other, and only the real
+// I/O is left to finish later
+ERROR_T DiskSystem::Submit(const bool write,
+			   const SIZE_T inoffblock,
+			   const vector<BYTE_T *> &bufs,
+			   double &reqtime,
+			   IOHandle &io,
+			   const function<void(const IORequest &)> &callback,
+			   DiskTicket *ticket,
+			   const double submit)
+{
+  SIZE_T numblock=bufs.size();
+
+  reqtime=0;
+  io.reset();
+
+  if (inoffblock+numblock > numblocks) { 
+    cerr << "DiskSystem::"<<(write ? "Write" : "Read")<<": Attempt to access blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+
+  if (ticket) {
+    *ticket=Enqueue(inoffblock,numblock,write,submit);
+  } else {
+    reqtime=ModelAccess(inoffblock,numblock,write);
+  }
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    if (!IsBlockAllocated(inoffblock+i)) { 
+      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+	cerr <<"DiskSystem::"<<(write ? "Write: writing" : "Read: reading")<<" unallocated block "<<(i+inoffblock)<<endl;
+      }
+    }
+  }
+
+  vector<struct iovec> iov(numblock);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    iov[i].iov_base=bufs[i];
+    iov[i].iov_len=blocksize;
+  }
+
+  if (!async || map || Misaligned(iov)) {
+    // nothing to wait for
+    return write ? WriteData(inoffblock,iov) : ReadData(inoffblock,iov);
+  }
+
+  io=IOHandle(new IORequest(write,(off_t)offset+(off_t)inoffblock*blocksize));
+  io->iov=iov;
+  io->bytes=numblock*blocksize;
+  io->callback=callback;
+  return async->Submit(io);
+}
+
+ERROR_T DiskSystem::ReadAsync(const SIZE_T inoffblock,
+			      const vector<BYTE_T *> &bufs,
+			      double &reqtime,
+			      IOHandle &io,
+			      const function<void(const IORequest &)> &callback)
+{
+  return Submit(false,inoffblock,bufs,reqtime,io,callback);
+}
+
+ERROR_T DiskSystem::WriteAsync(const SIZE_T inoffblock,
+			       const vector<const BYTE_T *> &bufs,
+			       double &reqtime,
+			       IOHandle &io,
+			       const function<void(const IORequest &)> &callback)
+{
+  vector<BYTE_T *> b;
+
+  for (vector<const BYTE_T *>::const_iterator i=bufs.begin(); i!=bufs.end(); ++i) {
+    b.push_back((BYTE_T *)*i);
+  }
+  return Submit(true,inoffblock,b,reqtime,io,callback);
+}
+
+ERROR_T DiskSystem::QueueRead(const SIZE_T inoffblock,
+			      const vector<BYTE_T *> &bufs,
+			      const double submit,
+			      DiskTicket &ticket,
+			      IOHandle &io,
+			      const function<void(const IORequest &)> &callback)
+{
+  double reqtime;
+
+  return Submit(false,inoffblock,bufs,reqtime,io,callback,&ticket,submit);
+}
+
+ERROR_T DiskSystem::QueueWrite(const SIZE_T inoffblock,
+			       const vector<const BYTE_T *> &bufs,
+			       const double submit,
+			       DiskTicket &ticket,
+			       IOHandle &io,
+			       const function<void(const IORequest &)> &callback)
+{
+  vector<BYTE_T *> b;
+  double reqtime;
+
+  for (vector<const BYTE_T *>::const_iterator i=bufs.begin(); i!=bufs.end(); ++i) {
+    b.push_back((BYTE_T *)*i);
+  }
+  return Submit(true,inoffblock,b,reqtime,io,callback,&ticket,submit);
+}
+
+DiskTicket DiskSystem::Enqueue(const SIZE_T block, const SIZE_T numblock, const bool write, const double submit)
+{
+  DiskTicket t(new DiskRequest(block,numblock,write,submit));
+
+  queue.push_back(t);
+  if (queuedepth==0) {
+    // no queue to speak of, so it is timed as it comes
+    Dispatch(t->submit>busyuntil ? t->submit : busyuntil);
+  }
+  return t;
+}
+
+// Makes the next scheduling decision, if the disk would make it by
+// limit: when it is free and one of the first queuedepth requests
+// has arrived, it serves the one it can get to soonest.  false if
+// there is nothing to decide by then.
+bool DiskSystem::Dispatch(const double limit)
+{
+  SIZE_T tags=queuedepth>0 ? queuedepth : 1;
+  SIZE_T n=queue.size()<tags ? queue.size() : tags;
+
+  if (n==0) {
+    return false;
+  }
+
+  double earliest=queue[0]->submit;
+
+  for (SIZE_T i=1; i<n; i++) {
+    if (queue[i]->submit<earliest) {
+      earliest=queue[i]->submit;
+    }
+  }
+
+  double now=busyuntil>earliest ? busyuntil : earliest;
+
+  if (now>limit) {
+    return false;
+  }
+
+  SIZE_T best=n;
+  double bestpos=0;
+
+  for (SIZE_T i=0; i<n; i++) {
+    if (queue[i]->submit<=now) {
+      double pos=EstimatePositioning(queue[i]->block);
+      if (best==n || pos<bestpos) {
+	best=i;
+	bestpos=pos;
+      }
+    }
+  }
+
+  DiskTicket t=queue[best];
+
+  queue.erase(queue.begin()+best);
+  t->start=now;
+  t->finish=now+ModelAccess(t->block,t->numblock,t->write);
+  t->done=true;
+  busyuntil=t->finish;
+
+  queuestats.requests++;
+  queuestats.totalwait+=t->start-t->submit;
+  queuestats.totalservice+=t->finish-t->start;
+  if (t->start-t->submit>queuestats.maxwait) {
+    queuestats.maxwait=t->start-t->submit;
+  }
+  if (queuetrace) {
+    *queuetrace << (t->write ? "write " : "read ")<<t->block<<" "<<t->numblock
+		<< " submit="<<t->submit
+		<< " start="<<t->start
+		<< " finish="<<t->finish
+		<< " wait="<<t->start-t->submit
+		<< " service="<<t->finish-t->start<<endl;
+  }
+  return true;
+}
+
+void DiskSystem::SetQueueDepth(const SIZE_T depth)
+{
+  // what is queued was queued under the old rules
+  CompleteAll();
+  queuedepth=depth;
+}
+
+void DiskSystem::Advance(const double now)
+{
+  while (Dispatch(now)) {
+  }
+}
+
+double DiskSystem::Complete(const DiskTicket &t)
+{
+  while (!t->done && Dispatch(HUGE_VAL)) {
+  }
+  return t->finish;
+}
+
+double DiskSystem::CompleteAll()
+{
+  while (Dispatch(HUGE_VAL)) {
+  }
+  return busyuntil;
+}
+
+bool DiskSystem::IsDone(const DiskTicket &t, const double now)
+{
+  Advance(now);
+  return t->done && t->finish<=now;
+}
+
+ERROR_T DiskSystem::Wait(const IOHandle &io)
+{
+  if (!io) {
+    return ERROR_NOERROR;
+  }
+  async->Wait(io);
+  return io->result;
+}
+
+void DiskSystem::Drain()
+{
+  if (async) {
+    async->Drain();
+  }
+}
+
+const char *DiskSystem::GetAsyncName() const
+{
+  return async ? async->GetName() : "none";
+}
+
+// What O_DIRECT on fd needs of buffers, offsets and lengths, 0 if
+// the file system does not do it.  The kernel says, where it can,
+// and otherwise a block device's logical block size is asked for,
+// and anything else is taken to be the traditional 512 bytes.
+static SIZE_T DirectAlignment(const int fd)
+{
+#ifdef STATX_DIOALIGN
+  struct statx sx;
+
+  if (statx(fd,"",AT_EMPTY_PATH,STATX_DIOALIGN,&sx)==0 && (sx.stx_mask & STATX_DIOALIGN)) {
+    if (sx.stx_dio_offset_align==0) {
+      return 0;
+    }
+    return sx.stx_dio_mem_align>sx.stx_dio_offset_align ? sx.stx_dio_mem_align : sx.stx_dio_offset_align;
+  }
+#endif
+  struct stat s;
+  int sectorsize;
+
+  if (fstat(fd,&s)==0 && S_ISBLK(s.st_mode) && ioctl(fd,BLKSSZGET,&sectorsize)==0) {
+    return sectorsize;
+  }
+  return 512;
+}
+
+ERROR_T DiskSystem::SetDirect(const bool on)
+{
+  if (on==direct) {
+    return ERROR_NOERROR;
+  }
+  if (on && map) {
+    // the map is the page cache
+    return ERROR_CONFLICT;
+  }
+
+  SIZE_T align=1;
+
+  if (on) {
+    if (!(align=DirectAlignment(datafilefd))) {
+      cerr << "DiskSystem::SetDirect: the file system does not do direct I/O"<<endl;
+      return ERROR_UNIMPL;
+    }
+    if (blocksize%align || offset%align) {
+      cerr << "DiskSystem::SetDirect: blocksize "<<blocksize<<" and offset "<<offset<<" must be multiples of the device's logical block size "<<align<<endl;
+      return ERROR_BADCONFIG;
+    }
+  }
+
+  int flags=fcntl(datafilefd,F_GETFL);
+
+  // requests in flight were issued the old way
+  Drain();
+  if (flags<0 || fcntl(datafilefd,F_SETFL,on ? flags|O_DIRECT : flags&~O_DIRECT)!=0) {
+    cerr << "DiskSystem::SetDirect: the file system does not do direct I/O"<<endl;
+    return ERROR_UNIMPL;
+  }
+  direct=on;
+  dioalign=align;
+  return ERROR_NOERROR;
+}
+
+// The map has to start on a page, and touching it past the end of
+// the file faults, so the file is grown to cover the disk first
+ERROR_T DiskSystem::SetMapped(const bool on)
+{
+  // nothing left in flight to land behind the map's back
+  Drain();
+  if (on && direct) {
+    return ERROR_CONFLICT;
+  }
+  if (on && !map) {
+    off_t pagesize=sysconf(_SC_PAGESIZE);
+    off_t start=offset-offset%pagesize;
+    off_t end=(off_t)offset+(off_t)numblocks*blocksize;
+    struct stat s;
+
+    if (fstat(datafilefd,&s)!=0 || (s.st_size<end && ftruncate(datafilefd,end)!=0)) {
+      return ERROR_NOFILE;
+    }
+    void *m=mmap(0,end-start,PROT_READ|PROT_WRITE,MAP_SHARED,datafilefd,start);
+    if (m==MAP_FAILED) {
+      cerr << "DiskSystem::SetMapped: can't map the data file\n";
+      return ERROR_NOMEM;
+    }
+    map=(BYTE_T *)m;
+    mapbytes=end-start;
+    mapskew=offset-start;
+  } else if (!on && map) {
+    int rc=msync(map,mapbytes,MS_SYNC);
+    munmap(map,mapbytes);
+    map=0;
+    mapbytes=mapskew=0;
+    if (rc!=0) {
+      return ERROR_IMPLBUG;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::View(const SIZE_T   inoffblock,
+			 const SIZE_T   numblock,
+			 const BYTE_T *&data,
+			 double        &reqtime)
+{
+  reqtime=0;
+
+  if (!map) {
+    return ERROR_UNIMPL;
+  }
+  if (inoffblock+numblock > numblocks) { 
+    cerr << "DiskSystem::View: Attempt to read blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+
+  reqtime=ModelAccess(inoffblock,numblock,false);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    if (!IsBlockAllocated(inoffblock+i)) { 
+      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+	cerr <<"DiskSystem::View: reading unallocated block "<<(i+inoffblock)<<endl;
+      }
+    }
+  }
+  data=BlockAddress(inoffblock);
+  return ERROR_NOERROR;
+}
+
+// msync wants whole pages
+ERROR_T DiskSystem::Sync(const SIZE_T inoffblock, const SIZE_T numblock)
+{
+  int rc=WriteBitMap();
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  if (!map || numblock==0) {
+    return ERROR_NOERROR;
+  }
+  if (inoffblock+numblock > numblocks) { 
+    return ERROR_NOSPACE;
+  }
+
+  size_t pagesize=sysconf(_SC_PAGESIZE);
+  size_t from=mapskew+(size_t)inoffblock*blocksize;
+  size_t to=mapskew+(size_t)(inoffblock+numblock)*blocksize;
+
+  from-=from%pagesize;
+  if (msync(map+from,to-from,MS_SYNC)!=0) {
+    cerr << "DiskSystem::Sync: msync has failed"<<endl;
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
 SIZE_T DiskSystem::GetBlockSize() const
 {
   return blocksize;
@@ -517,14 +1253,46 @@ SIZE_T DiskSystem::GetNumBlocks() const
 
 
 
-#define GETBIT(x) ((bitmap[(x)/8] >> (7-((x)%8))) & 0x1)
-#define SETBIT(x) do { bitmap[(x)/8] |= 0x1 << (7-((x)%8)); } while (0)
-#define CLEARBIT(x) do { bitmap[(x)/8] &= ~(0x1 << (7-((x)%8))); } while (0)
+uint64_t DiskSystem::ValidBits(const SIZE_T w) const
+{
+  SIZE_T n=numblocks-64*w;
+
+  return n>=64 ? ~0ULL : (1ULL<<n)-1;
+}
+
+SIZE_T DiskSystem::ChangeBits(const SIZE_T w, const uint64_t bits, const bool set)
+{
+  uint64_t old=bitmap[w];
+
+  bitmap[w] = set ? old|bits : old&~bits;
+  if (bitmap[w]==old) {
+    return 0;
+  }
+  dirtywords[w/64] |= 1ULL<<(w%64);
+  if (bitmap[w]==ValidBits(w)) {
+    fullwords[w/64] |= 1ULL<<(w%64);
+  } else {
+    fullwords[w/64] &= ~(1ULL<<(w%64));
+  }
+  if (!set && w<freehint) {
+    freehint=w;
+  }
+  return __builtin_popcountll(old^bitmap[w]);
+}
+
+// The bits of the word for block from first to last
+static uint64_t RangeBits(const SIZE_T w, const SIZE_T first, const SIZE_T last)
+{
+  SIZE_T lo = first>64*w ? first-64*w : 0;
+  SIZE_T hi = last<64*w+63 ? last-64*w : 63;
+
+  return (~0ULL>>(63-hi)) & (~0ULL<<lo);
+}
 
 
 bool DiskSystem::IsBlockAllocated(const SIZE_T block)
 {
-  return GETBIT(block);
+  return GetBit(block);
 }
 
 
@@ -534,15 +1302,20 @@ ERROR_T DiskSystem::NotifyAllocateBlocks(const SIZE_T offset, const SIZE_T innum
     cerr << "Disksystem: NotifyAllocateBlocks: Attempt to allocate"<<offset<<" to "<<(offset+innumblocks-1)<<" but maximum block is "<<(numblocks-1)<<endl;
     return ERROR_NOSUCHBLOCK;
   }
+  if (innumblocks==0) {
+    return ERROR_NOERROR;
+  }
 
+  SIZE_T last=offset+innumblocks-1;
 
-  for (SIZE_T i=offset; i<(offset+innumblocks); i++) { 
-    if (IsBlockAllocated(i)) {
-      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
-	cerr << "Disksystem: NotifyAllocateBlocks: Block "<<i<<" is being allocated, but it's already allocated!"<<endl;
+  for (SIZE_T w=offset/64; w<=last/64; w++) { 
+    uint64_t bits=RangeBits(w,offset,last);
+    if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+      for (uint64_t a=bitmap[w]&bits; a; a&=a-1) {
+	cerr << "Disksystem: NotifyAllocateBlocks: Block "<<64*w+__builtin_ctzll(a)<<" is being allocated, but it's already allocated!"<<endl;
       }
     }
-    SETBIT(i);
+    numallocated+=ChangeBits(w,bits,true);
   }
 
   return ERROR_NOERROR;
@@ -554,20 +1327,110 @@ ERROR_T DiskSystem::NotifyDeallocateBlocks(const SIZE_T offset,const SIZE_T innu
     cerr << "Disksystem: NotifyDeallocateBlocks: Attempt to deallocate"<<offset<<" to "<<(offset+innumblocks-1)<<" but maximum block is "<<(numblocks-1)<<endl;
     return ERROR_NOSUCHBLOCK;
   }
+  if (innumblocks==0) {
+    return ERROR_NOERROR;
+  }
 
+  SIZE_T last=offset+innumblocks-1;
 
-  for (SIZE_T i=offset; i<(offset+innumblocks); i++) { 
-    if (!IsBlockAllocated(i)) {
-      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
-	cerr << "Disksystem: NotifyDeallocateBlocks: Block "<<i<<" is being deallocated, but it's already deallocated!"<<endl;
+  for (SIZE_T w=offset/64; w<=last/64; w++) { 
+    uint64_t bits=RangeBits(w,offset,last);
+    if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+      for (uint64_t a=~bitmap[w]&bits; a; a&=a-1) {
+	cerr << "Disksystem: NotifyDeallocateBlocks: Block "<<64*w+__builtin_ctzll(a)<<" is being deallocated, but it's already deallocated!"<<endl;
       }
     }
-    CLEARBIT(i);
+    numallocated-=ChangeBits(w,bits,false);
+  }
+  // the device need not keep them any more
+  if (device) {
+    device->Discard(offset,innumblocks);
   }
 
   return ERROR_NOERROR;
 }
 
+// The first word at or after w that is not full, found through the
+// summary; bitmap.size() if there is none
+SIZE_T DiskSystem::NextFreeWord(const SIZE_T w) const
+{
+  SIZE_T s=w/64;
+
+  if (s>=fullwords.size()) {
+    return bitmap.size();
+  }
+
+  uint64_t open=~fullwords[s] & (~0ULL<<(w%64));
+
+  while (open==0) {
+    if (++s>=fullwords.size()) {
+      return bitmap.size();
+    }
+    open=~fullwords[s];
+  }
+
+  SIZE_T next=64*s+__builtin_ctzll(open);
+
+  return next<bitmap.size() ? next : bitmap.size();
+}
+
+// Runs of free and of allocated bits are each skipped with one
+// ctz per word, and full words 64 at a time
+ERROR_T DiskSystem::FindFreeBlocks(const SIZE_T num, SIZE_T &block, const SIZE_T from)
+{
+  if (num==0 || from>=numblocks) {
+    return ERROR_NOSPACE;
+  }
+
+  uint64_t p=from;
+
+  if (p<=64*(uint64_t)freehint) {
+    freehint=NextFreeWord(freehint);
+    if (p<64*(uint64_t)freehint) {
+      p=64*(uint64_t)freehint;
+    }
+  }
+
+  uint64_t start=0;
+  uint64_t len=0;
+
+  while (p<numblocks && len<num) {
+    SIZE_T w=p/64;
+
+    if (len==0 && p%64==0) {
+      if ((w=NextFreeWord(w))>=bitmap.size()) {
+	break;
+      }
+      p=64*(uint64_t)w;
+    }
+
+    // free blocks from p to the next allocated one
+    uint64_t used=bitmap[w]>>(p%64);
+    SIZE_T n = used ? __builtin_ctzll(used) : 64-p%64;
+
+    if (n>0) {
+      if (len==0) {
+	start=p;
+      }
+      len+=n;
+      p+=n;
+    }
+    if (used && len<num) {
+      // and past the allocated ones after them
+      uint64_t free=~(bitmap[w]>>(p%64));
+      len=0;
+      p += free ? __builtin_ctzll(free) : 64-p%64;
+    }
+  }
+
+  // the bits past the last block are clear, but not blocks
+  if (len<num || start+num>numblocks) {
+    return ERROR_NOSPACE;
+  }
+  block=start;
+  return ERROR_NOERROR;
+}
+
 
 ostream & DiskSystem::Print(ostream &os) const
 {
@@ -578,15 +1441,27 @@ ostream & DiskSystem::Print(ostream &os) const
      << ", numheads="<<numheads
      << ", blockspertrack="<<blockspertrack
      << ", numtracks="<<numtracks
-     << ", last_track="<<last_track
-     << ", last_sector="<<last_sector
      << ", averageseeklatency="<<averageseeklatency
      << ", trackseeklatency="<<trackseeklatency
      << ", rotationallatency="<<rotationallatency
+     << ", device="<<devicespec;
+  if (device) {
+    os << " "<<*device;
+  }
+  os
+     << ", mapped="<<(map ? "yes" : "no")
+     << ", direct="<<(direct ? "yes" : "no")
+     << ", async="<<GetAsyncName()
+     << ", queuedepth="<<queuedepth
+     << ", queued="<<queue.size()
+     << ", requests="<<queuestats.requests
+     << ", totalwait="<<queuestats.totalwait
+     << ", totalservice="<<queuestats.totalservice
+     << ", freeblocks="<<GetNumFreeBlocks()
      << ", bitmap=";
 
   for (SIZE_T i=0;i<numblocks;i++) { 
-    if (GETBIT(i)) { 
+    if (GetBit(i)) { 
       os <<"*";
     } else {
       os <<".";
@@ -4,23 +4,110 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <stdint.h>
+#include <sys/uio.h>
 
 #include "global.h"
 #include "block.h"
+#include "asyncio.h"
+#include "devicemodel.h"
 
 using namespace std;
 
-// Models a single disk with a single outstanding request
+//
+// A request in the disk's queue.  start and finish are set, and
+// done, once the disk has served it.
+//
+struct DiskRequest {
+  SIZE_T block;
+  SIZE_T numblock;
+  bool   write;
+  double submit;
+  double start;
+  double finish;
+  bool   done;
+
+  DiskRequest(const SIZE_T b, const SIZE_T n, const bool w, const double s) :
+    block(b), numblock(n), write(w), submit(s), start(0), finish(0), done(false) {}
+};
+
+typedef shared_ptr<DiskRequest> DiskTicket;
+
+// Totals over the requests the queue has served
+struct QueueStats {
+  SIZE_T requests;
+  double totalwait;      // from submit to start
+  double totalservice;   // from start to finish
+  double maxwait;
+
+  QueueStats() : requests(0), totalwait(0), totalservice(0), maxwait(0) {}
+};
+
+
+// Models a single disk
+//
+// What the disk is, and so how long a request takes, is up to the
+// device model filestem.config names (see devicemodel.h): the
+// rotating disk its geometry describes, by default, or an SSD, a
+// RAID array or RAM.
+//
+// Data normally moves with pread/pwrite.  SetMapped(true) maps the
+// disk's part of the data file instead (MAP_SHARED), so requests
+// are copies to and from the kernel's page cache without a system
+// call, View hands out pointers into it without copying at all, and
+// Sync is what makes writes durable.  Either way every request is
+// charged by ModelAccess as before.
+//
+// Requests made with QueueRead and QueueWrite are not charged as
+// they are made but go into a queue, each with the simulated time it
+// was submitted at, and the disk serves them when it is free.  With
+// SetQueueDepth(0), the default, it serves them in order of arrival,
+// each as soon as it arrives and the disk is free.  With depth n,
+// like NCQ, it picks among the first n waiting the one it can get to
+// soonest from where the last one left off (SPTF).  Each request's
+// ticket then says when it started and finished, ie, its queue wait
+// and service time.  The data itself moves when the request is made,
+// as for any other call.
+//
+// The model has one request outstanding at a time, but the real
+// I/O need not.  With SetAsync, ReadAsync and WriteAsync charge the
+// request and hand the I/O to an AsyncIO backend (see asyncio.h)
+// with up to depth requests in flight, and the buffers must be left
+// alone until Wait says the request is done.
+//
+// SetDirect opens the data file O_DIRECT, so blocks are not cached
+// twice, once by the kernel and once by a BufferCache.  Buffers
+// aligned to GetIOAlignment() go straight to the device; any others
+// are copied through an aligned buffer.  Direct and mapped are
+// exclusive.
 //
 // Includes storage allocator and free space bitmap to 
 // simplify project - REAL DISKS DO NOT HAVE ALLOCATORS OR BITMAPS
 //
+// The bitmap is kept in 64-bit words, bit b%64 of word b/64 for
+// block b, with a summary bit per word that says the word is full,
+// so free blocks are found a word (or 64 words) at a time.  Only
+// the words that changed are written back to filestem.bitmap, which
+// keeps its original layout of 8 blocks a byte, high bit first.
+//
 class DiskSystem {
  private:
-  BYTE_T *bitmap;
-  FILE*  datafilefd;
+  vector<uint64_t> bitmap;
+  vector<uint64_t> fullwords;   // a bit per bitmap word, set if all allocated
+  vector<uint64_t> dirtywords;  // a bit per bitmap word, set if not written yet
+  SIZE_T numallocated;
+  SIZE_T freehint;               // every word below it is full
+  int    datafilefd;     // raw descriptors, all I/O is positioned
   FILE*  configfilefd;
-  FILE*  bitmapfilefd;
+  int    bitmapfilefd;
+  BYTE_T *map;           // the disk's part of the data file, when mapped
+  size_t mapbytes;
+  size_t mapskew;        // offset is not page aligned, the map is
+  AsyncIO *async;        // background I/O, if any
+  bool   direct;         // data file opened O_DIRECT
+  SIZE_T dioalign;       // and what that needs of buffers
 
 
   //
@@ -33,16 +120,24 @@ class DiskSystem {
   SIZE_T numheads;
   SIZE_T blockspertrack;
   SIZE_T numtracks;
-  SIZE_T last_track;
-  SIZE_T last_sector;
     
 
   double averageseeklatency;
   double trackseeklatency;
   double rotationallatency;
 
+  string devicespec;    // what device the geometry is (see devicemodel.h)
+  DeviceModel *device;
+
+  SIZE_T queuedepth;
+  deque<DiskTicket> queue;     // waiting, in order of arrival
+  double busyuntil;            // when the disk is done with what it has started
+  QueueStats queuestats;
+  ostream *queuetrace;
+
  protected:
-  virtual double ModelAccess(const SIZE_T off, const SIZE_T num);
+  virtual double ModelAccess(const SIZE_T off, const SIZE_T num, const bool write);
+  ERROR_T CreateDevice();
 
   ERROR_T SanityCheckConfig();
   ERROR_T InitFromConfigFile();
@@ -50,7 +145,28 @@ class DiskSystem {
   ERROR_T ReadConfig();
   ERROR_T WriteConfig();
   ERROR_T ReadBitMap();
+  // Just the dirty words
   ERROR_T WriteBitMap();
+  bool    GetBit(const SIZE_T block) const { return (bitmap[block/64]>>(block%64)) & 1; }
+  // The bits of word w that stand for blocks of the disk
+  uint64_t ValidBits(const SIZE_T w) const;
+  // Sets or clears bits of word w, and returns how many changed
+  SIZE_T  ChangeBits(const SIZE_T w, const uint64_t bits, const bool set);
+  SIZE_T  NextFreeWord(const SIZE_T w) const;
+  ERROR_T Preallocate();
+  BYTE_T *BlockAddress(const SIZE_T block) const { return map+mapskew+block*blocksize; }
+  // One preadv/pwritev (or as few as it takes) for consecutive
+  // blocks, one iovec of GetBlockSize() bytes each
+  ERROR_T ReadData(const SIZE_T inoffblock, vector<struct iovec> &iov);
+  ERROR_T WriteData(const SIZE_T inoffblock, vector<struct iovec> &iov);
+  bool    Misaligned(const vector<struct iovec> &iov) const;
+  BYTE_T *Bounce(const vector<struct iovec> &iov, vector<struct iovec> &bounced) const;
+  // With ticket, the request is queued at submit rather than charged
+  ERROR_T Submit(const bool write, const SIZE_T inoffblock, const vector<BYTE_T *> &bufs,
+		 double &reqtime, IOHandle &io, const function<void(const IORequest &)> &callback,
+		 DiskTicket *ticket=0, const double submit=0);
+  DiskTicket Enqueue(const SIZE_T block, const SIZE_T numblock, const bool write, const double submit);
+  bool    Dispatch(const double limit);
   
    
  public:
@@ -67,7 +183,8 @@ class DiskSystem {
 	     const SIZE_T tracks=0,
 	     const double avgseek=0,
 	     const double trackseek=0,
-	     const double rotlat=0);
+	     const double rotlat=0,
+	     const string &device="disk");
   DiskSystem() { throw GenericException(); } 
   DiskSystem(const DiskSystem &rhs) { throw GenericException();}
   DiskSystem & operator=(const DiskSystem &rhs) { throw GenericException(); return *this;}
@@ -94,8 +211,133 @@ class DiskSystem {
 		const Block &blocks,
 		double &reqtime);
 
+  // Straight to or from a caller's buffer of numblock*GetBlockSize() bytes
+  ERROR_T Read(const SIZE_T inoffblock,
+	       const SIZE_T numblock,
+	       BYTE_T *buf,
+	       double &reqtime);
+
+  ERROR_T Write(const SIZE_T inoffblock,
+		const SIZE_T numblock,
+		const BYTE_T *buf,
+		double &reqtime);
+
+  // Gather: bufs.size() consecutive blocks, one buffer each,
+  // written as a single request
+  ERROR_T Write(const SIZE_T inoffblock,
+		const vector<const BYTE_T *> &bufs,
+		double &reqtime);
+
+  // Scatter: bufs.size() consecutive blocks read as a single
+  // request, one into each buffer
+  ERROR_T Read(const SIZE_T inoffblock,
+	       const vector<BYTE_T *> &bufs,
+	       double &reqtime);
+
+  // Real I/O in the background with up to depth requests in
+  // flight, 0 turns it off.  Takes io_uring where the kernel has it,
+  // a thread pool otherwise or with forcethreads.
+  ERROR_T SetAsync(const SIZE_T depth, const bool forcethreads=false);
+  // "io_uring", "threads" or "none"
+  const char *GetAsyncName() const;
+
+  // Scatter read and gather write that return once the request is
+  // submitted.  io is the request to Wait for, or empty if it is
+  // already done (no backend, or mapped).  callback, if any, runs
+  // when io is done, on whichever thread notices, and not at all
+  // when io comes back empty.
+  ERROR_T ReadAsync(const SIZE_T inoffblock,
+		    const vector<BYTE_T *> &bufs,
+		    double &reqtime,
+		    IOHandle &io,
+		    const function<void(const IORequest &)> &callback=0);
+  ERROR_T WriteAsync(const SIZE_T inoffblock,
+		     const vector<const BYTE_T *> &bufs,
+		     double &reqtime,
+		     IOHandle &io,
+		     const function<void(const IORequest &)> &callback=0);
+  // Queued versions of ReadAsync and WriteAsync, submitted at
+  // simulated time submit.  The queue calls are for one thread at
+  // a time.
+  ERROR_T QueueRead(const SIZE_T inoffblock,
+		    const vector<BYTE_T *> &bufs,
+		    const double submit,
+		    DiskTicket &ticket,
+		    IOHandle &io,
+		    const function<void(const IORequest &)> &callback=0);
+  ERROR_T QueueWrite(const SIZE_T inoffblock,
+		     const vector<const BYTE_T *> &bufs,
+		     const double submit,
+		     DiskTicket &ticket,
+		     IOHandle &io,
+		     const function<void(const IORequest &)> &callback=0);
+  // Serves whatever is queued first
+  void    SetQueueDepth(const SIZE_T depth);
+  SIZE_T  GetQueueDepth() const { return queuedepth; }
+  // Serves every request the disk would have started by now
+  void    Advance(const double now);
+  // Serves requests until t is done, and returns when it finished
+  double  Complete(const DiskTicket &t);
+  // Serves everything, and returns when the disk is free
+  double  CompleteAll();
+  // Whether t is done by now
+  bool    IsDone(const DiskTicket &t, const double now);
+  const QueueStats &GetQueueStats() const { return queuestats; }
+  // A line on os for each request served, 0 for none
+  void    SetQueueTrace(ostream *os) { queuetrace=os; }
+
+  // Until io is done, returns how it went.  Wait and Drain are safe
+  // to call alongside the other calls.
+  ERROR_T Wait(const IOHandle &io);
+  // Until every request is done
+  void    Drain();
+
+  // Bypass the kernel's page cache for the data file, or stop.
+  // ERROR_BADCONFIG unless blocksize and offset are multiples of the
+  // device's logical block size, ERROR_UNIMPL if the file system
+  // cannot, ERROR_CONFLICT if mapped.
+  ERROR_T SetDirect(const bool on);
+  bool    IsDirect() const { return direct; }
+  // What buffers should be aligned to, 1 unless direct
+  SIZE_T  GetIOAlignment() const { return dioalign; }
+
+  // Map the data file, or flush and unmap it
+  // ERROR_CONFLICT if direct
+  ERROR_T SetMapped(const bool on);
+  bool    IsMapped() const { return map!=0; }
+
+  // Zero copy read of numblock consecutive blocks, charged as a
+  // Read.  data points into the map, stays valid until it is
+  // unmapped, and sees later writes.
+  // ERROR_UNIMPL unless mapped
+  ERROR_T View(const SIZE_T inoffblock,
+	       const SIZE_T numblock,
+	       const BYTE_T *&data,
+	       double &reqtime);
+
+  // Make the blocks' writes durable (msync), and write out what
+  // changed of the bitmap.  Not a disk request as far as the model
+  // goes.
+  ERROR_T Sync(const SIZE_T inoffblock, const SIZE_T numblock);
+
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
+  // The disk's files are this plus .data, .config, ...
+  const string &GetFileStem() const { return diskfilestem; }
+
+  // Block numbers map onto tracks in order, so sorting by block
+  // number is sorting by track
+  SIZE_T GetTrack(const SIZE_T block) const;
+  // The block under the head, ie, where the last request ended
+  SIZE_T GetHeadBlock() const;
+  // Seek plus rotational delay to get to block from the current
+  // head position, without moving the head
+  double EstimatePositioning(const SIZE_T block) const;
+  // Time spent seeking and waiting for rotation in all requests
+  double GetSeekTime() const;
+  double GetRotationTime() const;
+  // What serves the requests, 0 if the config named none that works
+  const DeviceModel *GetDevice() const { return device; }
 
   //
   // These are notification functions that should be called when
@@ -109,6 +351,11 @@ class DiskSystem {
 
   bool    IsBlockAllocated(const SIZE_T offset);
 
+  // Where the first run of num free blocks at or after from starts
+  // ERROR_NOSPACE if there is none
+  ERROR_T FindFreeBlocks(const SIZE_T num, SIZE_T &block, const SIZE_T from=0);
+  SIZE_T  GetNumFreeBlocks() const { return numblocks-numallocated; }
+
 
   ostream & Print(ostream &os) const;
 };
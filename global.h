@@ -4,8 +4,16 @@
 #define _global
 
 
+#include <stdint.h>
+#include <inttypes.h>
+
 typedef unsigned char BYTE_T;
-typedef unsigned int SIZE_T;
+// Block numbers, counts and sizes; 64 bits so that a disk may have
+// more than 2^32 blocks, or more than 4 GB of them
+typedef uint64_t SIZE_T;
+// printf and scanf conversions for a SIZE_T, eg "%" PRI_SIZE_T
+#define PRI_SIZE_T PRIu64
+#define SCN_SIZE_T SCNu64
 typedef int ERROR_T;
 
 
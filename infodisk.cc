@@ -1,16 +1,34 @@
 #include <string>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "disksystem.h"
 
 
 void usage() 
 {
-  cerr << "usage: readdisk filestem\n";
+  cerr << "usage: infodisk [-D] filestem\n";
 }
 
 int main(int argc, char *argv[])
 {
+  bool direct=false;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"D"))!=-1) {
+    switch (opt) {
+    case 'D':
+      direct=true;
+      break;
+    default:
+      usage();
+      exit(-1);
+    }
+  }
+  // the remaining arguments are positional
+  argc-=optind-1;
+  argv+=optind-1;
+
 #if 0
   if (argc<2) { 
     usage();
@@ -19,8 +37,16 @@ int main(int argc, char *argv[])
 #endif
 
   DiskSystem disk(argv[1]);
+
+  if (direct) {
+    ERROR_T rc=disk.SetDirect(true);
+    if (rc!=ERROR_NOERROR) {
+      cerr << "Can't do direct I/O due to error "<<rc<<"\n";
+    }
+  }
   
   cerr << "Disk is as follows.\n" << disk << "\n";
+  cerr << "Direct I/O is "<<(disk.IsDirect() ? "active" : "not active")<<".\n";
 
   cerr << "Done.\n";
 
@@ -1,16 +1,38 @@
 #include <string>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "disksystem.h"
 
 
 void usage() 
 {
-  cerr << "usage: makedisk filestem blocks blocksize heads blockspertrack tracks avgseek trackseek rotlat\n";
+  cerr << "usage: makedisk [-D] [-m device] filestem blocks blocksize heads blockspertrack tracks avgseek trackseek rotlat\n";
 }
 
 int main(int argc, char *argv[])
 {
+  bool direct=false;
+  string device="disk";
+  int opt;
+
+  while ((opt=getopt(argc,argv,"Dm:"))!=-1) {
+    switch (opt) {
+    case 'D':
+      direct=true;
+      break;
+    case 'm':
+      device=optarg;
+      break;
+    default:
+      usage();
+      exit(-1);
+    }
+  }
+  // the remaining arguments are positional
+  argc-=optind-1;
+  argv+=optind-1;
+
   if (argc<10) { 
     usage();
     exit(-1);
@@ -19,17 +41,26 @@ int main(int argc, char *argv[])
   DiskSystem disk(argv[1],
 		  true,
 		  0,
-		  atoi(argv[2]),
-		  atoi(argv[3]),
-		  atoi(argv[4]),
-		  atoi(argv[5]),
-		  atoi(argv[6]),
+		  strtoull(argv[2],0,10),
+		  strtoull(argv[3],0,10),
+		  strtoull(argv[4],0,10),
+		  strtoull(argv[5],0,10),
+		  strtoull(argv[6],0,10),
 		  atof(argv[7]),
 		  atof(argv[8]),
-		  atof(argv[9]));
+		  atof(argv[9]),
+		  device);
+
+  if (direct) {
+    ERROR_T rc=disk.SetDirect(true);
+    if (rc!=ERROR_NOERROR) {
+      cerr << "Can't do direct I/O due to error "<<rc<<"\n";
+    }
+  }
   
   
   cerr << "Disk is as follows.\n" << disk << "\n";
+  cerr << "Direct I/O is "<<(disk.IsDirect() ? "active" : "not active")<<".\n";
 
   cerr << "Done.\n";
 
@@ -0,0 +1,138 @@
+#include <algorithm>
+
+#include "missratio.h"
+
+#define NO_BLOCK ((SIZE_T)-1)
+
+
+StackDistanceTracker::StackDistanceTracker(const SIZE_T d) :
+  maxdepth(d>0 ? d : 1), nextslot(0), oldestslot(0), numreads(0)
+{
+  // twice the live slots, so renumbering happens at most every
+  // maxdepth references
+  tree.resize(2*maxdepth+1,0);
+  blockat.resize(2*maxdepth,NO_BLOCK);
+  histogram.resize(maxdepth,0);
+}
+
+void StackDistanceTracker::Add(SIZE_T slot, const int delta)
+{
+  for (slot++; slot<tree.size(); slot+=slot&(~slot+1)) {
+    tree[slot]+=delta;
+  }
+}
+
+SIZE_T StackDistanceTracker::Prefix(SIZE_T slot) const
+{
+  SIZE_T sum=0;
+
+  for (; slot>0; slot-=slot&(~slot+1)) {
+    sum+=tree[slot];
+  }
+  return sum;
+}
+
+void StackDistanceTracker::Forget(const SIZE_T slot)
+{
+  Add(slot,-1);
+  slotof.erase(blockat[slot]);
+  blockat[slot]=NO_BLOCK;
+}
+
+// Live slots move down to the front, in the same order
+void StackDistanceTracker::Compact()
+{
+  SIZE_T live=0;
+
+  fill(tree.begin(),tree.end(),0);
+  for (SIZE_T s=oldestslot; s<nextslot; s++) {
+    if (blockat[s]!=NO_BLOCK) {
+      blockat[live]=blockat[s];
+      slotof[blockat[live]]=live;
+      Add(live,1);
+      live++;
+    }
+  }
+  fill(blockat.begin()+live,blockat.end(),NO_BLOCK);
+  nextslot=live;
+  oldestslot=0;
+}
+
+void StackDistanceTracker::Reference(const SIZE_T blocknum, const bool isread)
+{
+  unordered_map<SIZE_T, SIZE_T>::const_iterator i=slotof.find(blocknum);
+
+  if (i!=slotof.end()) {
+    SIZE_T slot=(*i).second;
+    // distinct blocks referenced since, always less than maxdepth
+    SIZE_T distance=Prefix(nextslot)-Prefix(slot+1);
+    if (isread) {
+      histogram[distance]++;
+    }
+    Forget(slot);
+  }
+  if (isread) {
+    numreads++;
+  }
+
+  if (nextslot==blockat.size()) {
+    Compact();
+  }
+  blockat[nextslot]=blocknum;
+  slotof[blocknum]=nextslot;
+  Add(nextslot,1);
+  nextslot++;
+
+  if (slotof.size()>maxdepth) {
+    while (blockat[oldestslot]==NO_BLOCK) {
+      oldestslot++;
+    }
+    Forget(oldestslot);
+  }
+}
+
+void StackDistanceTracker::Clear()
+{
+  fill(tree.begin(),tree.end(),0);
+  fill(blockat.begin(),blockat.end(),NO_BLOCK);
+  slotof.clear();
+  nextslot=0;
+  oldestslot=0;
+}
+
+double StackDistanceTracker::GetMissRatio(const SIZE_T size) const
+{
+  if (numreads==0) {
+    return 0;
+  }
+
+  SIZE_T hits=0;
+
+  for (SIZE_T d=0; d<size && d<maxdepth; d++) {
+    hits+=histogram[d];
+  }
+  return 1.0-(double)hits/(double)numreads;
+}
+
+ostream & StackDistanceTracker::Print(ostream &os, const SIZE_T extra) const
+{
+  vector<SIZE_T> sizes;
+
+  for (SIZE_T s=1; s<=maxdepth; s*=2) {
+    sizes.push_back(s);
+  }
+  if (extra>0 && extra<=maxdepth && find(sizes.begin(),sizes.end(),extra)==sizes.end()) {
+    sizes.push_back(extra);
+    sort(sizes.begin(),sizes.end());
+  }
+
+  os << "{";
+  for (vector<SIZE_T>::const_iterator s=sizes.begin(); s!=sizes.end(); ++s) {
+    if (s!=sizes.begin()) {
+      os << ", ";
+    }
+    os << *s << ":" << GetMissRatio(*s);
+  }
+  os << "}";
+  return os;
+}
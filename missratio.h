@@ -0,0 +1,63 @@
+#ifndef _missratio
+#define _missratio
+
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// LRU stack distances of a reference stream (Mattson et al)
+//
+// A read whose block was last referenced d distinct blocks ago hits
+// in any LRU cache of more than d blocks, so one pass over the
+// stream gives the miss ratio of every cache size at once.
+//
+// Each block's most recent reference holds a slot, slots are handed
+// out in time order, and a Fenwick tree over the slots counts how
+// many blocks were referenced since a given one.  Only the maxdepth
+// most recently referenced blocks are remembered, so the curve is
+// exact up to maxdepth blocks, and anything deeper counts as a miss.
+// Slots are renumbered when they run out, so references cost
+// amortized O(log maxdepth).
+//
+class StackDistanceTracker {
+ private:
+  SIZE_T maxdepth;
+  vector<SIZE_T> tree;        // Fenwick tree, 1 where a slot is some block's latest reference
+  vector<SIZE_T> blockat;     // block in each slot, NO_BLOCK if stale
+  unordered_map<SIZE_T, SIZE_T> slotof;
+  SIZE_T nextslot;
+  SIZE_T oldestslot;          // no live slot below this
+  vector<SIZE_T> histogram;   // reads at each stack distance
+  SIZE_T numreads;
+
+  void   Add(SIZE_T slot, const int delta);
+  SIZE_T Prefix(SIZE_T slot) const;  // live slots in [0,slot)
+  void   Forget(const SIZE_T slot);
+  void   Compact();
+ public:
+  StackDistanceTracker(const SIZE_T maxdepth);
+
+  // isread=false references (eg, writes of whole blocks) move the
+  // block to the top of the stack but are not counted
+  void   Reference(const SIZE_T blocknum, const bool isread);
+  // The stack is emptied, as when the cache is, but counts are kept
+  void   Clear();
+
+  SIZE_T GetMaxDepth() const { return maxdepth; }
+  SIZE_T GetNumReads() const { return numreads; }
+  // Fraction of reads an LRU cache of size blocks would miss,
+  // size is at most GetMaxDepth()
+  double GetMissRatio(const SIZE_T size) const;
+
+  // "size:missratio" for powers of two up to maxdepth, and extra
+  ostream & Print(ostream &os, const SIZE_T extra=0) const;
+};
+
+inline ostream & operator<<(ostream &os, const StackDistanceTracker &t) { return t.Print(os); }
+
+#endif
@@ -16,8 +16,8 @@ int main(int argc, char *argv[])
     exit(-1);
   }
   SIZE_T cachesize=atoi(argv[1]);
-  SIZE_T blocknum=atoi(argv[3]);
-  SIZE_T numblocks=atoi(argv[4]);
+  SIZE_T blocknum=strtoull(argv[3],0,10);
+  SIZE_T numblocks=strtoull(argv[4],0,10);
 
   DiskSystem disk(argv[2]);
   BufferCache cache(&disk,cachesize);
@@ -47,11 +47,13 @@ int main(int argc, char *argv[])
   cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
   cerr << "numreads        = "<<cache.GetNumReads()<<endl;
   cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+  cerr << "numreadaheads   = "<<cache.GetNumReadAheads()<<endl;
   cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
   cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
   cerr << endl;
 
   cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+  cerr << "memory (bytes)  = "<<cache.GetMemoryUsage()<<endl;
 
   return 0;
 }
@@ -15,27 +15,26 @@ int main(int argc, char *argv[])
     usage();
     exit(-1);
   }
-  SIZE_T blocknum=atoi(argv[2]);
-  SIZE_T numblocks=atoi(argv[3]);
+  SIZE_T blocknum=strtoull(argv[2],0,10);
+  SIZE_T numblocks=strtoull(argv[3],0,10);
   double reqtime;
 
   DiskSystem disk(argv[1]);
 
-  vector<Block> b;
+  // straight out of the mapped file, no copy
+  const BYTE_T *data;
+  ERROR_T rc=disk.SetMapped(true);
 
-  ERROR_T rc= disk.Read(blocknum, numblocks, b, reqtime);
+  if (rc==ERROR_NOERROR) {
+    rc=disk.View(blocknum, numblocks, data, reqtime);
+  }
 
   if (rc!=ERROR_NOERROR) { 
     cerr << "Error "<< rc << " occured.\n";
     return -1;
   } else {
     cerr << "Read took "<<reqtime<<" milliseconds\n";
-    for (vector<Block>::const_iterator i=b.begin();i!=b.end();++i) {
-      // cerr << (*i);
-      for (SIZE_T j=0;j<(*i).length;j++) { 
-	cout << (*i).data[j];
-      }
-    }
+    cout.write((const char *)data,numblocks*disk.GetBlockSize());
   }
   return 0;
 }
@@ -5,13 +5,14 @@
 #include <strstream>
 #include <fstream>
 #include "btree.h"
+#include "tooloptions.h"
 
 
 using namespace std;
 
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim " TOOL_OPTIONS_USAGE " [-M] [-D] [-w dirtyratio] [-e elevatorwindow] [-s numshards] [-m mrcdepth] [-k hotquota] [-r readahead] [-z victimblocks] [-a|-A asyncdepth] [-q queuedepth] [-Q] filestem cachesize < specfile \n";
 }
 
 
@@ -20,6 +21,70 @@ int main(int argc, char *argv[])
 
   // CONFORMS to the interface of ref_impl.pl
 
+  ToolOptions options;
+  bool mapped=false;
+  bool direct=false;
+  double dirtyratio=0.5;
+  SIZE_T elevatorwindow=4;
+  SIZE_T numshards=1;
+  SIZE_T mrcdepth=0;
+  double hotquota=0.25;
+  SIZE_T readahead=16;
+  SIZE_T victimblocks=0;
+  SIZE_T asyncdepth=0;
+  bool asyncthreads=false;
+  SIZE_T queuedepth=0;
+  bool queuetrace=false;
+
+  function<bool(const int, const char *)> simoptions=[&](const int opt, const char *arg) {
+    switch (opt) {
+    case 'M':
+      mapped=true;
+      break;
+    case 'D':
+      direct=true;
+      break;
+    case 'w':
+      dirtyratio=atof(arg);
+      break;
+    case 'e':
+      elevatorwindow=atoi(arg);
+      break;
+    case 's':
+      numshards=atoi(arg);
+      break;
+    case 'm':
+      mrcdepth=atoi(arg);
+      break;
+    case 'k':
+      hotquota=atof(arg);
+      break;
+    case 'r':
+      readahead=atoi(arg);
+      break;
+    case 'z':
+      victimblocks=atoi(arg);
+      break;
+    case 'a':
+    case 'A':
+      asyncdepth=atoi(arg);
+      asyncthreads = opt=='A';
+      break;
+    case 'q':
+      queuedepth=atoi(arg);
+      break;
+    case 'Q':
+      queuetrace=true;
+      break;
+    }
+    return true;
+  };
+
+  if (!options.Parse(argc,argv,"MDw:e:s:m:k:r:z:a:A:q:Q",simoptions)) {
+    usage();
+    return 1;
+  }
+
   if (argc != 3){
     usage();
     return 1;
@@ -38,7 +103,30 @@ int main(int argc, char *argv[])
   // run lots of operations
   // so we need to do this outside the loop
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  if (mapped && (rc=disk.SetMapped(true))!=ERROR_NOERROR) {
+    cerr << "Can't map disk due to error "<<rc<<"\n";
+    return -1;
+  }
+  if (direct && (rc=disk.SetDirect(true))!=ERROR_NOERROR) {
+    cerr << "Can't do direct I/O due to error "<<rc<<"\n";
+    return -1;
+  }
+  if ((rc=disk.SetAsync(asyncdepth,asyncthreads))!=ERROR_NOERROR) {
+    cerr << "Can't start async I/O due to error "<<rc<<"\n";
+    return -1;
+  }
+  disk.SetQueueDepth(queuedepth);
+  if (queuetrace) {
+    disk.SetQueueTrace(&cerr);
+  }
+  BufferCache cache(&disk,cachesize,options.policy,numshards);
+  options.Apply(cache);
+  cache.SetDirtyRatio(dirtyratio);
+  cache.SetElevatorWindow(elevatorwindow);
+  cache.TrackMissRatio(mrcdepth);
+  cache.SetHotQuota(hotquota);
+  cache.SetReadAhead(readahead);
+  cache.SetVictimCache(victimblocks);
   // will be set on init
   BTreeIndex *btree;
 
@@ -122,6 +210,35 @@ int main(int argc, char *argv[])
     
   fclose(file);
 
+  // stdout has to match ref_impl.pl, so the numbers go to stderr
+  cerr << "Performance statistics:\n";
+  cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+  cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+  cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+  cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+  cerr << "numwriteruns    = "<<cache.GetNumWriteRuns()<<endl;
+  cerr << "numwarmblocks   = "<<cache.GetNumWarmBlocks()<<endl;
+  cerr << "numreadaheads   = "<<cache.GetNumReadAheads()<<endl;
+  cerr << "numvictimhits   = "<<cache.GetNumVictimHits()<<endl;
+  cerr << "numasyncios     = "<<cache.GetNumAsyncIOs()<<" ("<<disk.GetAsyncName()<<", "<<cache.GetNumAsyncFailures()<<" failed)"<<endl;
+  cerr << "seek time       = "<<disk.GetSeekTime()<<endl;
+  cerr << "rotation time   = "<<disk.GetRotationTime()<<endl;
+  if (disk.GetDevice()) {
+    cerr << "device          = "<<*disk.GetDevice()<<endl;
+  }
+  const QueueStats &q=disk.GetQueueStats();
+  if (q.requests>0) {
+    cerr << "disk requests   = "<<q.requests<<" (queue depth "<<queuedepth
+	 << ", wait avg "<<q.totalwait/q.requests<<" max "<<q.maxwait
+	 << ", service avg "<<q.totalservice/q.requests<<")"<<endl;
+  }
+  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+  if (mrcdepth>0) {
+    // what the same run would have missed with an LRU cache of each size
+    cerr << "miss ratio curve= ";
+    cache.PrintMissRatioCurve(cerr) << endl;
+  }
+
   return 0;
 
 }
@@ -0,0 +1,43 @@
+#!/usr/bin/perl -w
+
+#
+# Checkpoints an index, crashes, attaches again and checks that the
+# index is sane and has every key, for each of the numbers of keys
+# given.  The cache is small so most of the nodes are dirty in it when
+# the checkpoint is taken.
+#
+$diskstem="__ckpt";
+$numblocks=1024;
+$blocksize=1024;
+$heads=1;
+$blockspertrack=1024;
+$tracks=1;
+$avgseek=10;
+$trackseek=1;
+$rotlat=10;
+$cachesize=8;
+$keysize=8;
+$valuesize=8;
+
+$#ARGV>=0 or die "usage: test_checkpoint.pl numkeys...\n";
+
+$ENV{PATH}.=":.";
+
+$failed=0;
+foreach $numkeys (@ARGV) {
+  system "deletedisk $diskstem > /dev/null 2>&1";
+  system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat > /dev/null 2>&1";
+  system "btree_init $diskstem 64 $keysize $valuesize > /dev/null 2>&1";
+  system "btree_checkpoint $diskstem $cachesize fill $numkeys > /dev/null 2>&1";
+  $out=`btree_checkpoint $diskstem $cachesize check $numkeys 2>&1`;
+  $ok=($?==0);
+  ($sane)=($out=~/sanity\s*=\s*(\S+)/);
+  ($found)=($out=~/numfound\s*=\s*(\S+)/);
+  $sane="?" if !defined($sane);
+  $found="?" if !defined($found);
+  print "$numkeys keys: sanity $sane, found $found: ".($ok ? "OK" : "FAILED")."\n";
+  $failed++ if !$ok;
+}
+system "deletedisk $diskstem > /dev/null 2>&1";
+
+exit($failed ? 1 : 0);
@@ -0,0 +1,45 @@
+#include <unistd.h>
+
+#include "tooloptions.h"
+
+
+bool ToolOptions::Parse(int &argc, char **&argv, const char *more,
+			const function<bool(const int opt, const char *arg)> &other)
+{
+  string optstring=string("p:HW")+more;
+  int opt;
+
+  while ((opt=getopt(argc,argv,optstring.c_str()))!=-1) {
+    switch (opt) {
+    case 'p':
+      policy=optarg;
+      break;
+    case 'H':
+      hugepages=true;
+      break;
+    case 'W':
+      warm=true;
+      break;
+    case '?':
+      return false;
+    default:
+      if (!other || !other(opt,optarg)) {
+	return false;
+      }
+      break;
+    }
+  }
+  if (!CachePolicy::IsValidName(policy)) {
+    return false;
+  }
+  // the remaining arguments are positional
+  argc-=optind-1;
+  argv+=optind-1;
+  return true;
+}
+
+void ToolOptions::Apply(BufferCache &cache) const
+{
+  cache.SetHugePages(hugepages);
+  cache.SetWarmManifest(warm);
+}
@@ -0,0 +1,39 @@
+#ifndef _tooloptions
+#define _tooloptions
+
+#include <string>
+#include <functional>
+
+#include "global.h"
+#include "buffercache.h"
+
+using namespace std;
+
+#define TOOL_OPTIONS_USAGE "[-p " CACHE_POLICY_NAMES "] [-H] [-W]"
+
+//
+// The options the btree_* tools and sim all take ahead of their
+// positional arguments: -p policy picks the cache's replacement
+// policy, -H backs its frames with huge pages, and -W starts it warm.
+//
+// A tool with options of its own gives Parse them in getopt form
+// (eg, "s:"), and a function that takes each one it finds along with
+// its argument, returning false if the argument will not do.
+//
+struct ToolOptions {
+  string policy;
+  bool   hugepages;
+  bool   warm;
+
+  ToolOptions() : policy("lru"), hugepages(false), warm(false) {}
+
+  // Leaves argv[0] the program and the rest the positional arguments.
+  // Returns false if an option is unknown, its argument will not do,
+  // or the policy is not one of CACHE_POLICY_NAMES.
+  bool Parse(int &argc, char **&argv, const char *more="",
+	     const function<bool(const int opt, const char *arg)> &other=0);
+  // Sets up cache as the options ask
+  void Apply(BufferCache &cache) const;
+};
+
+#endif
@@ -0,0 +1,171 @@
+#include <string.h>
+
+#include "victimcache.h"
+
+#define MIN_RUN     3
+#define MAX_RUN     (127+MIN_RUN)
+#define MAX_LITERAL 128
+
+
+// Control byte c < 0x80: c+1 literal bytes follow
+//              c >= 0x80: the next byte, (c&0x7f)+MIN_RUN times
+SIZE_T CompressBlock(const BYTE_T *src, const SIZE_T len, BYTE_T *dst, const SIZE_T room)
+{
+  SIZE_T in=0, out=0, literal=0;
+
+  while (in<len) {
+    SIZE_T run=1;
+    while (in+run<len && run<MAX_RUN && src[in+run]==src[in]) {
+      run++;
+    }
+    if (run>=MIN_RUN) {
+      if (out+2>room) {
+	return 0;
+      }
+      dst[out++]=0x80 | (BYTE_T)(run-MIN_RUN);
+      dst[out++]=src[in];
+      in+=run;
+      continue;
+    }
+    // literals up to the next run worth encoding
+    literal=in;
+    while (in<len && in-literal<MAX_LITERAL
+	   && !(in+2<len && src[in]==src[in+1] && src[in]==src[in+2])) {
+      in++;
+    }
+    if (out+1+(in-literal)>room) {
+      return 0;
+    }
+    dst[out++]=(BYTE_T)(in-literal-1);
+    memcpy(dst+out,src+literal,in-literal);
+    out+=in-literal;
+  }
+  return out;
+}
+
+bool DecompressBlock(const BYTE_T *src, const SIZE_T clen, BYTE_T *dst, const SIZE_T len)
+{
+  SIZE_T in=0, out=0;
+
+  while (in<clen) {
+    BYTE_T c=src[in++];
+    if (c & 0x80) {
+      SIZE_T run=(c & 0x7f)+MIN_RUN;
+      if (in>=clen || out+run>len) {
+	return false;
+      }
+      memset(dst+out,src[in++],run);
+      out+=run;
+    } else {
+      SIZE_T n=(SIZE_T)c+1;
+      if (in+n>clen || out+n>len) {
+	return false;
+      }
+      memcpy(dst+out,src+in,n);
+      in+=n;
+      out+=n;
+    }
+  }
+  return out==len;
+}
+
+
+CompressedVictimCache::CompressedVictimCache(const size_t b, const SIZE_T bs) :
+  budget(b), used(0), blocksize(bs), puts(0), hits(0), rejects(0)
+{
+  scratch.resize(blocksize);
+}
+
+void CompressedVictimCache::Put(const SIZE_T blocknum, const BYTE_T *data)
+{
+  Forget(blocknum);
+
+  // worth keeping only if it saves a quarter
+  SIZE_T clen=CompressBlock(data,blocksize,&scratch[0],blocksize-blocksize/4);
+
+  if (clen==0) {
+    rejects++;
+    return;
+  }
+
+  Entry e;
+  e.blocknum=blocknum;
+  e.data.assign(scratch.begin(),scratch.begin()+clen);
+
+  if (Cost(e)>budget) {
+    rejects++;
+    return;
+  }
+  while (used+Cost(e)>budget) {
+    Forget(entries.front().blocknum);
+  }
+  used+=Cost(e);
+  entries.push_back(e);
+  index[blocknum]=--entries.end();
+  puts++;
+}
+
+bool CompressedVictimCache::Take(const SIZE_T blocknum, BYTE_T *data)
+{
+  unordered_map<SIZE_T, list<Entry>::iterator>::iterator i=index.find(blocknum);
+
+  if (i==index.end()) {
+    return false;
+  }
+
+  const vector<BYTE_T> &c=(*(*i).second).data;
+  bool ok=DecompressBlock(&c[0],c.size(),data,blocksize);
+
+  Forget(blocknum);
+  if (ok) {
+    hits++;
+  }
+  return ok;
+}
+
+void CompressedVictimCache::Forget(const SIZE_T blocknum)
+{
+  unordered_map<SIZE_T, list<Entry>::iterator>::iterator i=index.find(blocknum);
+
+  if (i!=index.end()) {
+    used-=Cost(*(*i).second);
+    entries.erase((*i).second);
+    index.erase(i);
+  }
+}
+
+// A range bigger than what is kept is checked against the entries
+// instead, so freeing a whole disk costs no more than the cache holds
+void CompressedVictimCache::Forget(const SIZE_T blocknum, const SIZE_T num)
+{
+  if (num<=index.size()) {
+    for (SIZE_T i=0; i<num; i++) {
+      Forget(blocknum+i);
+    }
+    return;
+  }
+  for (list<Entry>::iterator i=entries.begin(); i!=entries.end(); ) {
+    list<Entry>::iterator e=i++;
+    if ((*e).blocknum>=blocknum && (*e).blocknum-blocknum<num) {
+      Forget((*e).blocknum);
+    }
+  }
+}
+
+void CompressedVictimCache::Clear()
+{
+  entries.clear();
+  index.clear();
+  used=0;
+}
+
+ostream & CompressedVictimCache::Print(ostream &os) const
+{
+  os << "CompressedVictimCache(budget="<<budget
+     << ", used="<<used
+     << ", blocks="<<index.size()
+     << ", puts="<<puts
+     << ", hits="<<hits
+     << ", rejects="<<rejects<<")";
+  return os;
+}
@@ -0,0 +1,85 @@
+#ifndef _victimcache
+#define _victimcache
+
+#include <iostream>
+#include <list>
+#include <vector>
+#include <unordered_map>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// Byte run codec for blocks
+//
+// Node blocks are mostly zero fill past their keys and values, so
+// a run of 3 or more equal bytes becomes a control byte and the
+// byte, and anything else goes through as literals, up to 128 at a
+// time behind a control byte.  The worst case is 1/128 bigger than
+// the input.
+//
+// Compress returns the size of the output, 0 if it would not fit in
+// room bytes.  Decompress returns false unless the input expands to
+// exactly len bytes.
+//
+SIZE_T CompressBlock(const BYTE_T *src, const SIZE_T len, BYTE_T *dst, const SIZE_T room);
+bool   DecompressBlock(const BYTE_T *src, const SIZE_T clen, BYTE_T *dst, const SIZE_T len);
+
+
+//
+// Second tier for clean blocks evicted from a BufferCache
+//
+// Blocks are kept compressed, up to a budget of bytes that counts
+// the compressed data and a fixed overhead per block, and the least
+// recently put go first when it runs out.  A block that does not
+// compress by at least a quarter is not kept, since the same memory
+// holds more of the ones that do.  A block leaves when it is taken
+// back, so it is never in the pool and the cache at once.
+//
+// Nothing here is locked; the cache does that.
+//
+class CompressedVictimCache {
+ private:
+  struct Entry {
+    SIZE_T         blocknum;
+    vector<BYTE_T> data;
+  };
+
+  size_t budget;
+  size_t used;
+  SIZE_T blocksize;
+  list<Entry> entries;   // oldest first
+  unordered_map<SIZE_T, list<Entry>::iterator> index;
+  vector<BYTE_T> scratch;
+  SIZE_T puts, hits, rejects;
+
+  size_t Cost(const Entry &e) const { return e.data.size()+sizeof(Entry)+2*sizeof(void *); }
+ public:
+  CompressedVictimCache(const size_t budget, const SIZE_T blocksize);
+
+  // Keeps a copy of a clean block, replacing any older one
+  void   Put(const SIZE_T blocknum, const BYTE_T *data);
+  // Copies the block out and forgets it, false if it is not here
+  bool   Take(const SIZE_T blocknum, BYTE_T *data);
+  bool   Contains(const SIZE_T blocknum) const { return index.find(blocknum)!=index.end(); }
+  // The block changed or went away, so any copy is stale
+  void   Forget(const SIZE_T blocknum);
+  // Forget for num blocks from blocknum on
+  void   Forget(const SIZE_T blocknum, const SIZE_T num);
+  void   Clear();
+
+  size_t GetBudget() const { return budget; }
+  size_t GetUsed() const { return used; }
+  SIZE_T GetNumBlocks() const { return index.size(); }
+  SIZE_T GetNumPuts() const { return puts; }
+  SIZE_T GetNumHits() const { return hits; }
+  // Blocks not kept because they did not compress well enough
+  SIZE_T GetNumRejects() const { return rejects; }
+
+  ostream & Print(ostream &os) const;
+};
+
+inline ostream & operator<<(ostream &os, const CompressedVictimCache &v) { return v.Print(os); }
+
+#endif
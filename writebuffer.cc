@@ -16,8 +16,8 @@ int main(int argc, char *argv[])
     exit(-1);
   }
   SIZE_T cachesize=atoi(argv[2]);
-  SIZE_T blocknum=atoi(argv[3]);
-  SIZE_T numblocks=atoi(argv[4]);
+  SIZE_T blocknum=strtoull(argv[3],0,10);
+  SIZE_T numblocks=strtoull(argv[4],0,10);
 
   DiskSystem disk(argv[1]);
   BufferCache cache(&disk,cachesize);
@@ -57,6 +57,7 @@ int main(int argc, char *argv[])
   cerr << endl;
 
   cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+  cerr << "memory (bytes)  = "<<cache.GetMemoryUsage()<<endl;
 
   return 0;
 }
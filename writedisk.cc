@@ -15,8 +15,8 @@ int main(int argc, char *argv[])
     usage();
     exit(-1);
   }
-  SIZE_T blocknum=atoi(argv[2]);
-  SIZE_T numblocks=atoi(argv[3]);
+  SIZE_T blocknum=strtoull(argv[2],0,10);
+  SIZE_T numblocks=strtoull(argv[3],0,10);
   double reqtime;
 
   DiskSystem disk(argv[1]);